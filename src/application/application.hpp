@@ -36,6 +36,18 @@ struct Options
 	int sample_depth;
 	int max_depth;
 	int num_per_path;
+	// importance sample the reconstruction filter instead of splatting
+	bool filter_sampling;
+	// halton, sobol, bluenoise, stratified or random; not allocated
+	const char* sampler_name;
+	// adaptive sampling: at most max_passes passes of num_samples, each
+	// one only over packets with pixels noisier than noise_target, until
+	// the film's mean error reaches noise_target or time_budget seconds
+	// (0 for none) have passed. The budget is checked per work tile and
+	// never cuts the first pass short.
+	int max_passes;
+	float noise_target;
+	float time_budget;
 };
 
 /**
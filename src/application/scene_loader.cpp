@@ -117,9 +117,11 @@ static void parse_attrib_int( const TiXmlElement* elem, bool required, const cha
     }
 }
 
-static void parse_attrib_double( const TiXmlElement* elem, bool required, const char* name, double* val )
+static void parse_attrib_double( const TiXmlElement* elem, bool required, const char* name, real_t* val )
 {
-    int rv = elem->QueryDoubleAttribute( name, val );
+    double d = *val;
+    int rv = elem->QueryDoubleAttribute( name, &d );
+    *val = d;
     if ( rv == TIXML_WRONG_TYPE ) {
         print_error_header( elem );
         std::cout << "error parsing '" << name << "'.\n";
@@ -163,7 +165,7 @@ template<> void parse_elem< int >( const TiXmlElement* elem, int* d )
     parse_attrib_int( elem, true, "v", d );
 }
 
-template<> void parse_elem< double >( const TiXmlElement* elem, double* d )
+template<> void parse_elem< real_t >( const TiXmlElement* elem, real_t* d )
 {
     parse_attrib_double( elem, true, "v", d );
 }
@@ -1,29 +1,44 @@
 
+#include <cmath>
 #include <cstring>
+#include <limits>
 #include <omp.h>
+#include <xmmintrin.h>
 #include "film.hpp"
 #include "filter.hpp"
 #include "scene/bvh.hpp"
+#include "math/arena.hpp"
 
 namespace _462 {
 Film::Film(uint32_t width, uint32_t height,
 	   uint32_t x_start, uint32_t x_end,
 	   uint32_t y_start, uint32_t y_end) : 
     width(width), height(height), x_start(x_start),
-    x_end(x_end), y_start(y_start), y_end(y_end), filter_ptr(NULL) {
+    x_end(x_end), y_start(y_start), y_end(y_end), filter_ptr(NULL),
+    filter_sampling(false) {
     uint32_t pixel_x = x_end - x_start;
     uint32_t pixel_y = y_end - y_start;
     colors = (Color3*)memalign(16, sizeof(real_t) * 3 * pixel_x * pixel_y);
     sum_weights = (float*)memalign(16, sizeof(float) * pixel_x * pixel_y);
     
+    sample_counts = (float*)memalign(16, sizeof(float) * pixel_x * pixel_y);
+    lum_sums = (float*)memalign(16, sizeof(float) * pixel_x * pixel_y);
+    lum_sq_sums = (float*)memalign(16, sizeof(float) * pixel_x * pixel_y);
+    
     memset(colors, 0, sizeof(real_t) * 3 * pixel_x * pixel_y);
     memset(sum_weights, 0, sizeof(float) * pixel_x * pixel_y);
+    memset(sample_counts, 0, sizeof(float) * pixel_x * pixel_y);
+    memset(lum_sums, 0, sizeof(float) * pixel_x * pixel_y);
+    memset(lum_sq_sums, 0, sizeof(float) * pixel_x * pixel_y);
 }
 
 Film::~Film() { 
     delete filter_ptr;
     _aligned_free(colors);
     _aligned_free(sum_weights);
+    _aligned_free(sample_counts);
+    _aligned_free(lum_sums);
+    _aligned_free(lum_sq_sums);
 }
 
 void Film::setFilter(Filter *filter_ptr) {
@@ -31,62 +46,356 @@ void Film::setFilter(Filter *filter_ptr) {
     this->filter_ptr->populate();
 }
 
-void Film::addSample(const Sample &sample, const Color3 color) {
-    int x0 = (int)(sample.x - filter_ptr->width_x + 0.5f);
-    int x1 = (int)(sample.x + filter_ptr->width_x - 0.5f);
-    int y0 = (int)(sample.y - filter_ptr->width_y + 0.5f);
-    int y1 = (int)(sample.y + filter_ptr->width_y - 0.5f);
+void Film::setFilterSampling(bool filter_sampling) {
+    this->filter_sampling = filter_sampling;
+}
+
+// The sample's position within its pixel picks the filter offset, so the
+// film recovers the weight from the unwarped sample alone.
+static float warpOffset(const Filter *filter_ptr, const Sample &sample,
+			float &x, float &y) {
+    float pixel_x = std::floor(sample.x), pixel_y = std::floor(sample.y);
+    float dx, dy;
+    float weight = filter_ptr->sample(sample.x - pixel_x, sample.y - pixel_y, dx, dy);
+    x = pixel_x + 0.5f + dx;
+    y = pixel_y + 0.5f + dy;
+    return weight;
+}
+
+Sample Film::warpSample(const Sample &sample) const {
+    Sample warped;
+    warpOffset(filter_ptr, sample, warped.x, warped.y);
+    return warped;
+}
+
+// Finds the one pixel of [x_start, x_end) x [y_start, y_end), stored row
+// by row, holding an importance sampled sample, and the sample's filter
+// sign. False when the pixel is outside.
+static bool pixelSample(const Filter *filter_ptr, const Sample &sample,
+			int x_start, int x_end, int y_start, int y_end,
+			int &pixel_offset, float &weight) {
+    int x = (int)std::floor(sample.x);
+    int y = (int)std::floor(sample.y);
+    if (x < x_start || x >= x_end || y < y_start || y >= y_end)
+	return false;
+
+    float warped_x, warped_y;
+    weight = warpOffset(filter_ptr, sample, warped_x, warped_y);
+    pixel_offset = (y - y_start) * (x_end - x_start) + x - x_start;
+    return true;
+}
+
+// Finds the pixels [x0, x1] x [y0, y1] of [x_start, x_end) x [y_start,
+// y_end) a splatted sample reaches. The filter is separable, so their
+// weights are the outer product of wx and wy, which come from the
+// calling thread's arena. False when no pixel is reached.
+static bool filterFootprint(const Filter *filter_ptr, const Sample &sample,
+			    int x_start, int x_end, int y_start, int y_end,
+			    int &x0, int &x1, int &y0, int &y1, float *&wx, float *&wy) {
+    x0 = (int)(sample.x - filter_ptr->width_x + 0.5f);
+    x1 = (int)(sample.x + filter_ptr->width_x - 0.5f);
+    y0 = (int)(sample.y - filter_ptr->width_y + 0.5f);
+    y1 = (int)(sample.y + filter_ptr->width_y - 0.5f);
     
-    x0 = std::max((int)x_start, x0);
-    x1 = std::min((int)x_end - 1, x1);
-    y0 = std::max((int)y_start, y0);
-    y1 = std::min((int)y_end - 1, y1);
+    x0 = std::max(x_start, x0);
+    x1 = std::min(x_end - 1, x1);
+    y0 = std::max(y_start, y0);
+    y1 = std::min(y_end - 1, y1);
     
     if (!((x0 <= x1) && (y0 <= y1)))
-	return ;
-
-    assert((x0 <= x1) && (y0 <= y1));
+	return false;
 
-    int *ifx = new int[x1 - x0 + 1], *ify = new int[y1 - y0 + 1];
+    FrameArena& arena = FrameArena::local();
+    wx = arena.alloc<float>(x1 - x0 + 1);
+    wy = arena.alloc<float>(y1 - y0 + 1);
 
     for (int x = x0; x <= x1; x++) {
-	ifx[x - x0] = (int)((sample.x - x + filter_ptr->width_x - 0.5f) / 
-			    (2 * filter_ptr->width_x) * (filter_ptr->table_edge - 1));
+	int ifx = (int)((sample.x - x + filter_ptr->width_x - 0.5f) / 
+			(2 * filter_ptr->width_x) * (filter_ptr->table_edge - 1));
+	wx[x - x0] = filter_ptr->weights_x[ifx];
     }
 
     for (int y = y0; y <= y1; y++) {
-	ify[y - y0] = (int)((sample.y - y + filter_ptr->width_y - 0.5f) / 
-			    (2 * filter_ptr->width_y) * (filter_ptr->table_edge - 1));
+	int ify = (int)((sample.y - y + filter_ptr->width_y - 0.5f) / 
+			(2 * filter_ptr->width_y) * (filter_ptr->table_edge - 1));
+	wy[y - y0] = filter_ptr->weights_y[ify];
+    }
+    return true;
+}
+
+// Adds w * color and w to one pixel shared with other threads.
+static void addAtomic(const Color3 &color, float w, Color3 *des_color, float *sum) {
+    #pragma omp atomic
+    des_color->r += w * color.r;
+    #pragma omp atomic
+    des_color->g += w * color.g;
+    #pragma omp atomic
+    des_color->b += w * color.b;
+    #pragma omp atomic
+    *sum += w;
+}
+
+// Adds wy * wx[i] times color and the weight itself to the i-th of n
+// pixels of a row of color planes, four pixels at a time.
+static void addWeightedRow(float wy, const float *wx, int n, const Color3 &color,
+			   float *row_r, float *row_g, float *row_b, float *row_sums) {
+    __m128 wy4 = _mm_set1_ps(wy);
+    __m128 r4 = _mm_set1_ps(color.r);
+    __m128 g4 = _mm_set1_ps(color.g);
+    __m128 b4 = _mm_set1_ps(color.b);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+	__m128 w4 = _mm_mul_ps(wy4, _mm_loadu_ps(wx + i));
+	_mm_storeu_ps(row_sums + i, _mm_add_ps(_mm_loadu_ps(row_sums + i), w4));
+	_mm_storeu_ps(row_r + i, _mm_add_ps(_mm_loadu_ps(row_r + i), _mm_mul_ps(w4, r4)));
+	_mm_storeu_ps(row_g + i, _mm_add_ps(_mm_loadu_ps(row_g + i), _mm_mul_ps(w4, g4)));
+	_mm_storeu_ps(row_b + i, _mm_add_ps(_mm_loadu_ps(row_b + i), _mm_mul_ps(w4, b4)));
+    }
+    for (; i < n; i++) {
+	float w = wy * wx[i];
+	row_sums[i] += w;
+	row_r[i] += w * color.r;
+	row_g[i] += w * color.g;
+	row_b[i] += w * color.b;
+    }
+}
+
+// Counts the sample's luminance toward the error estimate of the pixel
+// holding it.
+template <bool Atomic>
+static void addSampleStats(const Sample &sample, const Color3 &color,
+			   float *sample_counts, float *lum_sums, float *lum_sq_sums,
+			   int x_start, int x_end, int y_start, int y_end) {
+    int x = (int)std::floor(sample.x);
+    int y = (int)std::floor(sample.y);
+    if (x < x_start || x >= x_end || y < y_start || y >= y_end)
+	return ;
+
+    Color3 c = color;
+    float lum = c.relative_luminance();
+    int pixel_offset = (y - y_start) * (x_end - x_start) + x - x_start;
+    if (Atomic) {
+	#pragma omp atomic
+	sample_counts[pixel_offset] += 1.f;
+	#pragma omp atomic
+	lum_sums[pixel_offset] += lum;
+	#pragma omp atomic
+	lum_sq_sums[pixel_offset] += lum * lum;
+    }
+    else {
+	sample_counts[pixel_offset] += 1.f;
+	lum_sums[pixel_offset] += lum;
+	lum_sq_sums[pixel_offset] += lum * lum;
+    }
+}
+
+void Film::addSample(const Sample &sample, const Color3 color) {
+    addSampleStats<true>(sample, color, sample_counts, lum_sums, lum_sq_sums,
+			 x_start, x_end, y_start, y_end);
+    if (filter_sampling) {
+	int pixel_offset;
+	float weight;
+	if (pixelSample(filter_ptr, sample, x_start, x_end, y_start, y_end,
+			pixel_offset, weight))
+	    addAtomic(color, weight, colors + pixel_offset, sum_weights + pixel_offset);
+	return ;
     }
 
+    int x0, x1, y0, y1;
+    float *wx, *wy;
+    FrameArena::Scope scope(FrameArena::local());
+    if (!filterFootprint(filter_ptr, sample, x_start, x_end, y_start, y_end,
+			 x0, x1, y0, y1, wx, wy))
+	return ;
+
     for (int y = y0; y <= y1; y++) {
-		for (int x = x0; x <= x1; x++) {
-			int offset = ify[y - y0] * filter_ptr->table_edge + ifx[x - x0];
-			float filter_value = filter_ptr->filter_table[offset];
-	    
+	for (int x = x0; x <= x1; x++) {
+	    int pixel_offset = (y - y_start) * (x_end - x_start) + x - x_start;
+	    addAtomic(color, wy[y - y0] * wx[x - x0],
+		      colors + pixel_offset, sum_weights + pixel_offset);
+	}
+    }
+}
+
+void Film::addSamples(const Sample *samples, const Color3 *colors, uint32_t n,
+		      uint32_t sample_size) {
+    if (n == 0)
+	return ;
+
+    // pixels holding the samples; the tile adds the filter apron
+    float min_x = samples->x, max_x = samples->x;
+    float min_y = samples->y, max_y = samples->y;
+    for (uint32_t i = 1; i < n; i++) {
+	const Sample &sample = *(const Sample*)((const float*)samples + i * sample_size);
+	min_x = std::min(min_x, sample.x);
+	max_x = std::max(max_x, sample.x);
+	min_y = std::min(min_y, sample.y);
+	max_y = std::max(max_y, sample.y);
+    }
+    uint32_t tile_x_start = (uint32_t)std::max((int)x_start, (int)std::floor(min_x));
+    uint32_t tile_x_end = (uint32_t)std::max((int)tile_x_start, std::min((int)x_end, (int)std::floor(max_x) + 1));
+    uint32_t tile_y_start = (uint32_t)std::max((int)y_start, (int)std::floor(min_y));
+    uint32_t tile_y_end = (uint32_t)std::max((int)tile_y_start, std::min((int)y_end, (int)std::floor(max_y) + 1));
+
+    FrameArena::Scope scope(FrameArena::local());
+    FilmTile tile(*this, tile_x_start, tile_x_end, tile_y_start, tile_y_end);
+    tile.addSamples(samples, colors, n, sample_size);
+    mergeTile(tile);
+}
+
+void Film::mergeTile(const FilmTile &tile, FilmApron *apron) {
+    int tile_x = tile.x_end - tile.x_start;
+
+    // Pixels other tiles can reach through their aprons: all of them
+    // unless the tile is exclusive, else its apron and a border of its own
+    // region as wide as the apron. The rest of the tile is only ever
+    // written here.
+    int core_x_start = tile.own_x_start + tile.apron_x;
+    int core_x_end = tile.own_x_end - tile.apron_x;
+    int core_y_start = tile.own_y_start + tile.apron_y;
+    int core_y_end = tile.own_y_end - tile.apron_y;
+    if (apron == NULL)
+	core_x_end = core_x_start;
+
+    for (int y = tile.y_start; y < tile.y_end; y++) {
+		bool core_row = y >= core_y_start && y < core_y_end;
+		for (int x = tile.x_start; x < tile.x_end; x++) {
+			int tile_offset = (y - tile.y_start) * tile_x + x - tile.x_start;
+			float weight = tile.sum_weights[tile_offset];
+			float count = tile.sample_counts[tile_offset];
+			if (weight == 0 && count == 0)
+				continue;
+			float r = tile.colors_r[tile_offset];
+			float g = tile.colors_g[tile_offset];
+			float b = tile.colors_b[tile_offset];
+			float lum_sum = tile.lum_sums[tile_offset];
+			float lum_sq_sum = tile.lum_sq_sums[tile_offset];
+
 			int pixel_offset = (y - y_start) * (x_end - x_start) + x - x_start;
 			Color3 *des_color = colors + pixel_offset;
-			float *sum = sum_weights + pixel_offset;
 
-			// Assume filters all have width >= 1
+			if (core_row && x >= core_x_start && x < core_x_end) {
+				sample_counts[pixel_offset] += count;
+				lum_sums[pixel_offset] += lum_sum;
+				lum_sq_sums[pixel_offset] += lum_sq_sum;
+				*des_color += Color3(r, g, b);
+				sum_weights[pixel_offset] += weight;
+				continue;
+			}
+
+			if (apron) {
+				float values[7] = { r, g, b, weight, count, lum_sum, lum_sq_sum };
+				apron->offsets.push_back(pixel_offset);
+				apron->values.insert(apron->values.end(), values, values + 7);
+				continue;
+			}
+
+			if (count > 0) {
+				#pragma omp atomic
+				sample_counts[pixel_offset] += count;
+				#pragma omp atomic
+				lum_sums[pixel_offset] += lum_sum;
+				#pragma omp atomic
+				lum_sq_sums[pixel_offset] += lum_sq_sum;
+			}
+
 			#pragma omp atomic
-			des_color->r += filter_value * color.r;
+			des_color->r += r;
 			#pragma omp atomic
-			des_color->g += filter_value * color.g;
+			des_color->g += g;
 			#pragma omp atomic
-			des_color->b += filter_value * color.b;
+			des_color->b += b;
 			#pragma omp atomic
-			*sum += filter_value;
-	 
-			/* known bug for test scene   
-			if ((x - x_start) == 421 && (y - y_start) == 140)
-			printf("%d, %d (%d) : %f %f - %f\n", x, y, offset, *sum, filter_value, color.r);
-			*/
+			sum_weights[pixel_offset] += weight;
 		}
     }
+}
+
+void Film::mergeApron(const FilmApron &apron) {
+    const float *values = apron.values.empty() ? NULL : &apron.values[0];
+    for (size_t i = 0; i < apron.offsets.size(); i++, values += 7) {
+	int pixel_offset = apron.offsets[i];
+	colors[pixel_offset] += Color3(values[0], values[1], values[2]);
+	sum_weights[pixel_offset] += values[3];
+	sample_counts[pixel_offset] += values[4];
+	lum_sums[pixel_offset] += values[5];
+	lum_sq_sums[pixel_offset] += values[6];
+    }
+}
+
+FilmTile::FilmTile(const Film &film, uint32_t x_start, uint32_t x_end,
+		   uint32_t y_start, uint32_t y_end) :
+    filter_ptr(film.filter_ptr), filter_sampling(film.filterSampling()) {
+    uint32_t film_x_start, film_x_end, film_y_start, film_y_end;
+    film.getPixelExtent(film_x_start, film_x_end, film_y_start, film_y_end);
+
+    // splatted samples of the tile reach pixels up to a filter width
+    // outside it; importance sampled ones stay in their own pixel
+    apron_x = filter_sampling ? 0 : (int)std::ceil(filter_ptr->width_x);
+    apron_y = filter_sampling ? 0 : (int)std::ceil(filter_ptr->width_y);
+    own_x_start = x_start;
+    own_x_end = x_end;
+    own_y_start = y_start;
+    own_y_end = y_end;
+    this->x_start = std::max((int)film_x_start, (int)x_start - apron_x);
+    this->x_end = std::min((int)film_x_end, (int)x_end + apron_x);
+    this->y_start = std::max((int)film_y_start, (int)y_start - apron_y);
+    this->y_end = std::min((int)film_y_end, (int)y_end + apron_y);
+
+    int pixels = std::max(0, this->x_end - this->x_start) * std::max(0, this->y_end - this->y_start);
+    FrameArena& arena = FrameArena::local();
+    colors_r = arena.alloc<float>(pixels);
+    colors_g = arena.alloc<float>(pixels);
+    colors_b = arena.alloc<float>(pixels);
+    sum_weights = arena.alloc<float>(pixels);
+    sample_counts = arena.alloc<float>(pixels);
+    lum_sums = arena.alloc<float>(pixels);
+    lum_sq_sums = arena.alloc<float>(pixels);
+    memset(colors_r, 0, sizeof(float) * pixels);
+    memset(colors_g, 0, sizeof(float) * pixels);
+    memset(colors_b, 0, sizeof(float) * pixels);
+    memset(sum_weights, 0, sizeof(float) * pixels);
+    memset(sample_counts, 0, sizeof(float) * pixels);
+    memset(lum_sums, 0, sizeof(float) * pixels);
+    memset(lum_sq_sums, 0, sizeof(float) * pixels);
+}
+
+void FilmTile::addSample(const Sample &sample, const Color3 color) {
+    addSampleStats<false>(sample, color, sample_counts, lum_sums, lum_sq_sums,
+			  x_start, x_end, y_start, y_end);
+    if (filter_sampling) {
+	int pixel_offset;
+	float weight;
+	if (pixelSample(filter_ptr, sample, x_start, x_end, y_start, y_end,
+			pixel_offset, weight)) {
+	    colors_r[pixel_offset] += weight * color.r;
+	    colors_g[pixel_offset] += weight * color.g;
+	    colors_b[pixel_offset] += weight * color.b;
+	    sum_weights[pixel_offset] += weight;
+	}
+	return ;
+    }
+
+    int x0, x1, y0, y1;
+    float *wx, *wy;
+    FrameArena::Scope scope(FrameArena::local());
+    if (!filterFootprint(filter_ptr, sample, x_start, x_end, y_start, y_end,
+			 x0, x1, y0, y1, wx, wy))
+	return ;
+
+    for (int y = y0; y <= y1; y++) {
+	int row_offset = (y - y_start) * (x_end - x_start) + x0 - x_start;
+	addWeightedRow(wy[y - y0], wx, x1 - x0 + 1, color,
+		       colors_r + row_offset, colors_g + row_offset,
+		       colors_b + row_offset, sum_weights + row_offset);
+    }
+}
 
-	delete[] ifx;
-	delete[] ify;
+void FilmTile::addSamples(const Sample *samples, const Color3 *colors, uint32_t n,
+			  uint32_t sample_size) {
+    const float *sample = (const float*)samples;
+    for (uint32_t i = 0; i < n; i++, sample += sample_size)
+	addSample(*(const Sample*)sample, colors[i]);
 }
 
 void Film::splat(const Sample &sample, const Color3 color) {
@@ -109,13 +418,54 @@ void Film::splat(const Sample &sample, const Color3 color) {
 
 }
 
+float Film::pixelError(int pixel_offset) const {
+    float n = sample_counts[pixel_offset];
+    if (n < 2)
+	return std::numeric_limits<float>::infinity();
+
+    float mean = lum_sums[pixel_offset] / n;
+    float variance = std::max(0.f, (lum_sq_sums[pixel_offset] - n * mean * mean) / (n - 1));
+    // standard error of the mean, relative to the mean; the floor keeps
+    // near-black pixels from asking for endless samples
+    return std::sqrt(variance / n) / (mean + 1e-2f);
+}
+
+float Film::tileError(int x0, int x1, int y0, int y1) const {
+    x0 = std::max(x0, (int)x_start);
+    x1 = std::min(x1, (int)x_end);
+    y0 = std::max(y0, (int)y_start);
+    y1 = std::min(y1, (int)y_end);
+
+    float error = 0.f;
+    for (int y = y0; y < y1; y++) {
+	for (int x = x0; x < x1; x++)
+	    error = std::max(error, pixelError((y - y_start) * (x_end - x_start) + x - x_start));
+    }
+    return error;
+}
+
+float Film::meanError() const {
+    uint32_t pixels = (x_end - x_start) * (y_end - y_start);
+    double error = 0;
+    uint32_t estimated = 0;
+    for (uint32_t i = 0; i < pixels; i++) {
+	if (sample_counts[i] < 2)
+	    continue;
+	error += pixelError(i);
+	estimated++;
+    }
+    if (estimated == 0)
+	return pixels ? std::numeric_limits<float>::infinity() : 0.f;
+    return (float)(error / estimated);
+}
+
 void Film::getSampleSize(uint32_t &width, uint32_t &height) {
     width = this->width;
     height = this->height;
 }
 
 void Film::getPixelExtent(uint32_t &x_start, uint32_t &x_end,
-			  uint32_t &y_start, uint32_t &y_end) {
+			  uint32_t &y_start, uint32_t &y_end) const {
     x_start = this->x_start;
     x_end = this->x_end;
     y_start = this->y_start;
@@ -2,12 +2,24 @@
 #ifndef _462_FILM_HPP_
 #define _462_FILM_HPP_
 
+#include <vector>
 #include "sample/sampler.hpp"
 #include "math/color.hpp"
 
 namespace _462 {
 
 class Filter;
+class FilmTile;
+
+// Pixels of an exclusive tile that other tiles also reach, held back by
+// Film::mergeTile so they can be added in a fixed order.
+struct FilmApron {
+    // film pixel offsets
+    std::vector<int> offsets;
+    // per pixel: r, g, b, weight, sample count, luminance sum and squared
+    // luminance sum
+    std::vector<float> values;
+};
 
 class Film {
 public:
@@ -17,13 +29,43 @@ public:
     ~Film();
 
     void setFilter(Filter *filter_ptr);
+    // In filter importance sampling mode each sample's ray goes through
+    // warpSample(sample), and its radiance lands on the one pixel holding
+    // the sample with weight +-1 instead of being splatted through the
+    // filter table.
+    void setFilterSampling(bool filter_sampling);
+    bool filterSampling() const { return filter_sampling; }
+    Sample warpSample(const Sample &sample) const;
 
     void addSample(const Sample &sample, const Color3 color);
+    // Adds n samples, sample_size floats apart, and their colors in one
+    // call. They are splatted into a private tile that is merged once.
+    void addSamples(const Sample *samples, const Color3 *colors, uint32_t n,
+		    uint32_t sample_size = 2);
     void splat(const Sample &sample, const Color3 color);
+    // Adds a finished tile, apron included, to the film with atomic adds.
+    // Given apron, the tile must be exclusive: no other tile merged at the
+    // same time has pixels of its own region. Other tiles then reach it
+    // only through their aprons, so all but a filter-wide border of it
+    // takes plain adds, and that border and the tile's apron go to apron
+    // for mergeApron.
+    void mergeTile(const FilmTile &tile, FilmApron *apron = NULL);
+    // Adds an apron held back by mergeTile. Not thread-safe; adding the
+    // aprons of a pass in a fixed order keeps the film independent of the
+    // thread schedule.
+    void mergeApron(const FilmApron &apron);
+
+    // Estimated relative error of the pixel means, from the luminance
+    // of the unfiltered samples landing in each pixel: the worst pixel of
+    // [x0, x1) x [y0, y1), and the average over the film. A pixel with
+    // fewer than two samples has infinite error; the average skips such
+    // pixels and is infinite only when no pixel has an estimate.
+    float tileError(int x0, int x1, int y0, int y1) const;
+    float meanError() const;
 
     void getSampleSize(uint32_t &width, uint32_t &height);
     void getPixelExtent(uint32_t &x_start, uint32_t &x_end,
-			uint32_t &y_start, uint32_t &y_end);
+			uint32_t &y_start, uint32_t &y_end) const;
 
     void output(unsigned char* buffer);
 
@@ -34,6 +76,48 @@ private:
     uint32_t x_start, x_end, y_start, y_end;
     Color3 *colors;
     float *sum_weights;
+    bool filter_sampling;
+    // per pixel sample count, luminance sum and squared luminance sum
+    float *sample_counts, *lum_sums, *lum_sq_sums;
+
+    float pixelError(int pixel_offset) const;
+};
+
+/*
+ * Private accumulator for one tile of a film, owned by the thread that
+ * renders the tile. It covers the tile plus an apron as wide as the
+ * filter, so every sample of the tile splats here without atomics and
+ * the film is touched once per pixel in Film::mergeTile. With filter
+ * importance sampling there is no apron. Tiles should span many packets,
+ * so the apron stays small next to the tile. The buffers come
+ * from the thread's FrameArena and live until the arena is reset.
+ */
+class FilmTile {
+public:
+    // Pixels [x_start, x_end) x [y_start, y_end) of film.
+    FilmTile(const Film &film, uint32_t x_start, uint32_t x_end,
+	     uint32_t y_start, uint32_t y_end);
+
+    void addSample(const Sample &sample, const Color3 color);
+    // As Film::addSamples.
+    void addSamples(const Sample *samples, const Color3 *colors, uint32_t n,
+		    uint32_t sample_size = 2);
+
+private:
+    friend class Film;
+
+    const Filter *filter_ptr;
+    bool filter_sampling;
+    // covered pixels, apron included and clipped to the film
+    int x_start, x_end, y_start, y_end;
+    // the tile's own pixels and the apron width around them
+    int own_x_start, own_x_end, own_y_start, own_y_end;
+    int apron_x, apron_y;
+    // color planes, so a row of the footprint is added four pixels at a
+    // time
+    float *colors_r, *colors_g, *colors_b;
+    float *sum_weights;
+    float *sample_counts, *lum_sums, *lum_sq_sums;
 };
 
 }
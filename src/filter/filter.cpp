@@ -1,8 +1,44 @@
 
+#include <algorithm>
+#include <cmath>
 #include "filter.hpp"
 
 namespace _462 {
 
+// Builds the CDF of |profile| over table_edge bins, given the profile
+// sampled at the bin centers.
+static void build_cdf(const std::vector<float> &profile,
+		      std::vector<float> &cdf, std::vector<float> &sign) {
+    cdf.resize(profile.size() + 1);
+    sign.resize(profile.size());
+
+    cdf[0] = 0.f;
+    for (size_t i = 0; i < profile.size(); i++) {
+	cdf[i + 1] = cdf[i] + std::abs(profile[i]);
+	sign[i] = (profile[i] < 0) ? -1.f : 1.f;
+    }
+
+    float total = cdf.back();
+    for (size_t i = 1; i < cdf.size(); i++)
+	cdf[i] = (total > 0) ? cdf[i] / total : float(i) / profile.size();
+}
+
+// Inverts cdf at u; returns the offset in [-width, width] and sets the
+// sign of the bin it falls in.
+static float sample_cdf(const std::vector<float> &cdf, const std::vector<float> &sign,
+			float width, float u, float &weight) {
+    size_t bins = sign.size();
+    size_t i = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+    i = std::min(std::max(i, (size_t)1), bins) - 1;
+
+    float span = cdf[i + 1] - cdf[i];
+    float t = (span > 0) ? (u - cdf[i]) / span : 0.5f;
+    t = std::min(std::max(t, 0.f), 1.f);
+
+    weight = sign[i];
+    return (i + t) * (2 * width) / bins - width;
+}
+
 void Filter::populate() {
     if (filter_table != NULL)
 	return ;
@@ -16,6 +52,30 @@ void Filter::populate() {
 	    *flt++ = evaluate(table_x, table_y);
 	}
     }
+
+    // Profiles through the filter center; the other axis only scales them.
+    std::vector<float> profile_x(table_edge), profile_y(table_edge);
+    for (uint32_t i = 0; i < table_edge; i++) {
+	profile_x[i] = evaluate((i + 0.5f) * (2 * width_x) / table_edge, width_y);
+	profile_y[i] = evaluate(width_x, (i + 0.5f) * (2 * width_y) / table_edge);
+    }
+
+    // f(x, y) = f(x, c) * f(c, y) / f(c, c) for a separable f centered at c
+    float center = evaluate(width_x, width_y);
+    weights_x = profile_x;
+    weights_y = profile_y;
+    for (uint32_t i = 0; i < table_edge; i++)
+	weights_x[i] = (center != 0) ? weights_x[i] / center : 0.f;
+
+    build_cdf(profile_x, cdf_x, sign_x);
+    build_cdf(profile_y, cdf_y, sign_y);
+}
+
+float Filter::sample(float u, float v, float &dx, float &dy) const {
+    float weight_x, weight_y;
+    dx = sample_cdf(cdf_x, sign_x, width_x, u, weight_x);
+    dy = sample_cdf(cdf_y, sign_y, width_y, v, weight_y);
+    return weight_x * weight_y;
 }
 
 }
@@ -2,6 +2,7 @@
 #ifndef _462_FILTER_HPP_
 #define _462_FILTER_HPP_
 
+#include <vector>
 #include "math/math.hpp"
 
 namespace _462 {
@@ -18,9 +19,23 @@ public:
     virtual float evaluate(float x, float y) = 0;
     virtual void populate();
 
+    // Warps (u, v) in [0, 1)^2 to an offset (dx, dy) from the pixel center
+    // distributed like |filter|. Returns the filter's sign at the offset,
+    // which is the sample's weight; every filter here is separable, so
+    // each axis is sampled from its own tabulated profile.
+    float sample(float u, float v, float &dx, float &dy) const;
+
     float width_x, width_y;
     uint32_t table_edge;
     float *filter_table;
+
+    // Every filter here is g(x) * h(y), so filter_table is also the outer
+    // product weights_y[j] * weights_x[i] of these per-axis weights.
+    std::vector<float> weights_x, weights_y;
+    // table_edge + 1 entry CDFs of |filter| along each axis, and the sign
+    // of the filter in each of the table_edge bins
+    std::vector<float> cdf_x, cdf_y;
+    std::vector<float> sign_x, sign_y;
 };
 
 }
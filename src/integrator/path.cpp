@@ -4,6 +4,7 @@
 #include "math/random462.hpp"
 #include "light/area.hpp"
 #include "material/bxdf.hpp"
+#include "math/arena.hpp"
 #include "path.hpp"
 
 namespace _462 {
@@ -115,7 +116,7 @@ Color3 PathIntegrator::li(const Scene *scene_ptr, const Ray &ray, const hitRecor
 
 			if (i >= sample_depth) {
 				// TODO : how to determine the prob?
-				float continue_prob = std::min(0.5, path_weight.relative_luminance());
+				float continue_prob = std::min<real_t>(0.5, path_weight.relative_luminance());
 				if (rng.random() > continue_prob)
 					break;
 				path_weight /= continue_prob;
@@ -124,13 +125,14 @@ Color3 PathIntegrator::li(const Scene *scene_ptr, const Ray &ray, const hitRecor
 				break;
 			}
 
-			Ray path_ray(p, wi);
+			Ray path_ray(Ray::offset_origin(p, n, wi), wi);
 			if (!scene_ptr->hit(path_ray, 1e-3, BIG_NUMBER, path_record, true)) {
 				if (specular_bounce)
 					for (uint32_t i = 0; i < scene_ptr->num_lights(); i++)
 						L += path_weight * scene_ptr->get_lights()[i]->Le(path_ray);
 				break;
 			}
+			scene_ptr->shade_hit(path_ray, path_record);
 
 			current_ray.e = path_ray.e;
 			current_ray.d = path_ray.d;
@@ -144,4 +146,195 @@ Color3 PathIntegrator::li(const Scene *scene_ptr, const Ray &ray, const hitRecor
 }
 
 
+// One path of a packet between bounces. Slots index the batched rays of
+// the current depth, -1 when the path traced none.
+struct PathVertex {
+	hitRecord record;
+	Ray ray;
+	Color3 weight;
+	Color3 direct_weight;
+	DirectLightRays direct;
+	Ray next;
+	bool alive;
+	bool specular;
+	bool extend;
+	int shadow_slot;
+	int bsdf_slot;
+	int next_slot;
+};
+
+// Same estimate as li(), drawing from each ray's rng in the same order,
+// but advanced one depth at a time over the whole packet so the shadow
+// rays and the bsdf and bounce rays of every path go through the batched
+// scene hit together.
+void PathIntegrator::li_packet(const Scene *scene_ptr, const Packet &packet, const hitRecord *records,
+				const Sample *const *samples, Random462 *rngs, Color3 *L) {
+	uint32_t n = packet.size;
+	FrameArena& arena = FrameArena::local();
+	FrameArena::Scope scope(arena);
+	PathVertex *paths = arena.alloc<PathVertex>(n);
+	Ray *shadow_rays = arena.alloc<Ray>(n);
+	real_t *shadow_t0 = arena.alloc<real_t>(n);
+	real_t *shadow_t1 = arena.alloc<real_t>(n);
+	hitRecord *shadow_hits = arena.alloc<hitRecord>(n);
+	// bsdf rays of the direct estimate and the bounce rays share a batch
+	Ray *closest_rays = arena.alloc<Ray>(2 * n);
+	real_t *closest_t0 = arena.alloc<real_t>(2 * n);
+	real_t *closest_t1 = arena.alloc<real_t>(2 * n);
+	hitRecord *closest_hits = arena.alloc<hitRecord>(2 * n);
+	hitRecord no_hit;
+
+	for (uint32_t k = 0; k < n; k++)
+		L[k] = Color3::Black();
+
+	for (uint32_t j = 0; j < num_per_path; j++) {
+		for (uint32_t k = 0; k < n; k++) {
+			paths[k].record = records[k];
+			paths[k].ray = packet.get_ray(k);
+			paths[k].weight = Color3::White();
+			paths[k].specular = false;
+			paths[k].alive = records[k].shape_ptr != NULL;
+		}
+
+		for (uint32_t i = 0; i < max_depth; i++) {
+			uint32_t num_shadow = 0;
+			uint32_t num_closest = 0;
+
+			for (uint32_t k = 0; k < n; k++) {
+				PathVertex &v = paths[k];
+				v.shadow_slot = v.bsdf_slot = v.next_slot = -1;
+				if (!v.alive)
+					continue;
+
+				const Sample *sample_ptr = samples[k];
+				Random462 &rng = rngs[k];
+				Vector3 p = v.record.p;
+				Vector3 n = v.record.n;
+				Vector3 wo = -v.ray.d;
+				BSDF *bsdf_ptr = v.record.bsdf_ptr;
+				LightSampleSet light_set;
+				BSDFSampleSet bsdf_set;
+				BSDFSample path_sample;
+				float select;
+
+				if (i == 0 || v.specular) {
+					if (v.record.shape_ptr->light_ptr != NULL)
+						L[k] += v.weight * v.record.shape_ptr->light_ptr->L(n, wo);
+				}
+
+				if (v.record.shape_ptr->light_ptr != NULL) {
+					v.alive = false;
+					continue;
+				}
+
+				light_set.num = 1;
+				bsdf_set.num = 1;
+				if (i < sample_depth) {
+					light_set.light_1d = (float*) sample_ptr + 2 + light_offsets[j * sample_depth + i].offset_1d;
+					light_set.light_2d = (float*) sample_ptr + 2 + light_offsets[j * sample_depth + i].offset_2d;
+					bsdf_set.bsdf_1d = (float*) sample_ptr + 2 + bsdf_offsets[j * sample_depth + i].offset_1d;
+					bsdf_set.bsdf_2d = (float*) sample_ptr + 2 + bsdf_offsets[j * sample_depth + i].offset_2d;
+					float* path_sample_ptr = (float*) sample_ptr + 2 + path_offsets[j * sample_depth + i].offset_2d;
+					path_sample.r1 = path_sample_ptr[0];
+					path_sample.r2 = path_sample_ptr[1];
+					path_sample.c = *((float*) sample_ptr + 2 + path_offsets[j * sample_depth + i].offset_1d);
+
+					select = *((float*)sample_ptr + 2);
+				}
+				else {
+					light_set.light_1d = NULL;
+					light_set.light_2d = NULL;
+					bsdf_set.bsdf_1d = NULL;
+					bsdf_set.bsdf_2d = NULL;
+					path_sample.r1 = rng.random();
+					path_sample.r2 = rng.random();
+					path_sample.c = rng.random();
+
+					select = -1;
+				}
+
+				prepare_one_light(scene_ptr, bsdf_ptr, p, n, wo, select, &light_set, &bsdf_set, rng, v.direct);
+				v.direct_weight = v.weight;
+				if (v.direct.has_shadow) {
+					v.shadow_slot = num_shadow;
+					shadow_rays[num_shadow] = v.direct.shadow;
+					shadow_t0[num_shadow] = v.direct.shadow_t0;
+					shadow_t1[num_shadow] = v.direct.shadow_t1;
+					num_shadow++;
+				}
+				if (v.direct.has_bsdf) {
+					v.bsdf_slot = num_closest;
+					closest_rays[num_closest] = v.direct.bsdf;
+					closest_t0[num_closest] = 1e-3;
+					closest_t1[num_closest] = BIG_NUMBER;
+					num_closest++;
+				}
+
+				Vector3 wi;
+				float path_pdf;
+				BxDFType flags;
+				Color3 f = bsdf_ptr->sample_f(wo, path_sample.r1,path_sample.r2, path_sample.c, 
+					&wi, n, &path_pdf, BSDF_ALL, &flags);
+				v.extend = !(f == Color3::Black() || path_pdf < 1e-3);
+				if (!v.extend)
+					continue;
+				v.specular = (flags & BSDF_SPECULAR) > 0;
+				v.weight *= f * std::fabs(dot(n, wi)) / path_pdf;
+
+				if (i >= sample_depth) {
+					float continue_prob = std::min<real_t>(0.5, v.weight.relative_luminance());
+					if (rng.random() > continue_prob) {
+						v.extend = false;
+						continue;
+					}
+					v.weight /= continue_prob;
+				}
+
+				v.next = Ray(Ray::offset_origin(p, n, wi), wi);
+				v.next_slot = num_closest;
+				closest_rays[num_closest] = v.next;
+				closest_t0[num_closest] = 1e-3;
+				closest_t1[num_closest] = BIG_NUMBER;
+				num_closest++;
+			}
+
+			if (num_shadow == 0 && num_closest == 0)
+				break;
+			scene_ptr->hit(shadow_rays, shadow_t0, shadow_t1, num_shadow, shadow_hits, false);
+			scene_ptr->hit(closest_rays, closest_t0, closest_t1, num_closest, closest_hits, true);
+
+			for (uint32_t k = 0; k < n; k++) {
+				PathVertex &v = paths[k];
+				if (!v.alive)
+					continue;
+
+				bool occluded = v.shadow_slot >= 0 && shadow_hits[v.shadow_slot].t >= 0;
+				bool found = v.bsdf_slot >= 0 && closest_hits[v.bsdf_slot].t >= 0;
+				hitRecord &bsdf_hit = v.bsdf_slot >= 0 ? closest_hits[v.bsdf_slot] : no_hit;
+				L[k] += v.direct_weight * finish_direct_light(scene_ptr, v.direct, occluded, found, bsdf_hit);
+
+				if (!v.extend) {
+					v.alive = false;
+					continue;
+				}
+
+				hitRecord &h = closest_hits[v.next_slot];
+				if (h.t < 0) {
+					if (v.specular)
+						for (uint32_t l = 0; l < scene_ptr->num_lights(); l++)
+							L[k] += v.weight * scene_ptr->get_lights()[l]->Le(v.next);
+					v.alive = false;
+					continue;
+				}
+				scene_ptr->shade_hit(v.next, h);
+				v.record = h;
+				v.ray = v.next;
+			}
+		}
+	}
+
+	for (uint32_t k = 0; k < n; k++)
+		L[k] /= num_per_path;
+}
+
 }
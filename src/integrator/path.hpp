@@ -18,6 +18,8 @@ public:
 
 	Color3 li(const Scene *scene_ptr, const Ray &ray, const hitRecord &record, const Sample* sample_ptr,
 				Random462 &rng);
+	void li_packet(const Scene *scene_ptr, const Packet &packet, const hitRecord *records,
+				const Sample *const *samples, Random462 *rngs, Color3 *L);
 	void initialize_sampler(const Scene *scene_ptr, Sampler *sampler_ptr);
 private:
 	uint32_t sample_depth;
@@ -8,26 +8,38 @@
 
 namespace _462 {
 
+static void draw_direct_samples(const LightSampleSet *light_sampleset_ptr, const BSDFSampleSet *bsdf_sampleset_ptr,
+								uint32_t j, Random462 &rng, LightSample &light_sample, BSDFSample &bsdf_sample) {
+	light_sample.r1 = (light_sampleset_ptr && light_sampleset_ptr->light_2d) ? light_sampleset_ptr->light_2d[j * 2] : rng.random();
+	light_sample.r2 = (light_sampleset_ptr && light_sampleset_ptr->light_2d) ? light_sampleset_ptr->light_2d[j * 2 + 1] : rng.random();
+	light_sample.c = (light_sampleset_ptr && light_sampleset_ptr->light_1d) ? light_sampleset_ptr->light_1d[j] : rng.random();
+
+	bsdf_sample.r1 = (bsdf_sampleset_ptr && bsdf_sampleset_ptr->bsdf_2d) ? bsdf_sampleset_ptr->bsdf_2d[j * 2] : rng.random();
+	bsdf_sample.r2 = (bsdf_sampleset_ptr && bsdf_sampleset_ptr->bsdf_2d) ? bsdf_sampleset_ptr->bsdf_2d[j * 2 + 1] : rng.random();
+	bsdf_sample.c = (bsdf_sampleset_ptr && bsdf_sampleset_ptr->bsdf_1d) ? bsdf_sampleset_ptr->bsdf_1d[j] : rng.random();
+}
+
+static int select_light(const Scene *scene_ptr, const float light_select, Random462 &rng) {
+	float r_select = (light_select < 0) ? rng.random() : light_select;
+	int selected = (int)(scene_ptr->num_lights() * r_select);
+
+	return (selected >= scene_ptr->num_lights()) ? scene_ptr->num_lights() -  1 : selected;
+}
+
 Color3 uniform_sample_all_lights(const Scene *scene_ptr, BSDF *bsdf_ptr, const Vector3 &p, const Vector3 &n, const Vector3 &wo, 
 								 const LightSampleSet* light_sampleset_ptr, const BSDFSampleSet* bsdf_sampleset_ptr,
 								Random462 &rng) {
 	Color3 L = Color3::Black();
+	LightSample light_sample(0.f, 0.f, 0.f);
+	BSDFSample bsdf_sample;
 
 	for (uint32_t i = 0; i < scene_ptr->num_lights(); i++) {
 		Color3 Ld = Color3::Black();
 		uint32_t num = (light_sampleset_ptr) ? light_sampleset_ptr[i].num : 1;
 
 		for (uint32_t j = 0; j < num; j++) {
-			float l_r1 = (light_sampleset_ptr && light_sampleset_ptr[i].light_2d) ? light_sampleset_ptr[i].light_2d[j * 2] : rng.random();
-			float l_r2 = (light_sampleset_ptr && light_sampleset_ptr[i].light_2d) ? light_sampleset_ptr[i].light_2d[j * 2 + 1] : rng.random();
-			float l_c = (light_sampleset_ptr && light_sampleset_ptr[i].light_1d) ? light_sampleset_ptr[i].light_1d[j] : rng.random();
-			LightSample light_sample(l_r1, l_r2, l_c);
-
-			float b_r1 = (bsdf_sampleset_ptr && bsdf_sampleset_ptr[i].bsdf_2d) ? bsdf_sampleset_ptr[i].bsdf_2d[j * 2] : rng.random();
-			float b_r2 = (bsdf_sampleset_ptr && bsdf_sampleset_ptr[i].bsdf_2d) ? bsdf_sampleset_ptr[i].bsdf_2d[j * 2 + 1] : rng.random();
-			float b_c = (bsdf_sampleset_ptr && bsdf_sampleset_ptr[i].bsdf_1d) ? bsdf_sampleset_ptr[i].bsdf_1d[j] : rng.random();
-			BSDFSample bsdf_sample(b_r1, b_r2, b_c);
-
+			draw_direct_samples(light_sampleset_ptr ? &light_sampleset_ptr[i] : NULL,
+				bsdf_sampleset_ptr ? &bsdf_sampleset_ptr[i] : NULL, j, rng, light_sample, bsdf_sample);
 			Ld += estimate_direct_light(scene_ptr, scene_ptr->get_lights()[i], bsdf_ptr, p, n, wo,
 				light_sample, bsdf_sample, rng, BxDFType(BSDF_ALL & ~BSDF_SPECULAR));
 		}
@@ -41,24 +53,15 @@ Color3 uniform_sample_one_light(const Scene *scene_ptr, BSDF *bsdf_ptr, const Ve
 								const LightSampleSet *light_sampleset_ptr, const BSDFSampleSet *bsdf_sampleset_ptr,
 								Random462 &rng) {
 	Color3 L = Color3::Black();
-	float r_select = (light_select < 0) ? rng.random() : light_select;
-	int selected = (int)(scene_ptr->num_lights() * r_select);
-
-	selected = (selected >= scene_ptr->num_lights()) ? scene_ptr->num_lights() -  1 : selected;
+	int selected = select_light(scene_ptr, light_select, rng);
+	LightSample light_sample(0.f, 0.f, 0.f);
+	BSDFSample bsdf_sample;
 
 	Color3 Ld = Color3::Black();
 	uint32_t num = (light_sampleset_ptr) ? light_sampleset_ptr->num : 1;
 	
 	for (uint32_t j = 0; j < num; j++) {
-		float l_r1 = (light_sampleset_ptr && light_sampleset_ptr->light_2d) ? light_sampleset_ptr->light_2d[j * 2] : rng.random();
-		float l_r2 = (light_sampleset_ptr && light_sampleset_ptr->light_2d) ? light_sampleset_ptr->light_2d[j * 2 + 1] : rng.random();
-		float l_c = (light_sampleset_ptr && light_sampleset_ptr->light_1d) ? light_sampleset_ptr->light_1d[j] : rng.random();
-		LightSample light_sample(l_r1, l_r2, l_c);
-
-		float b_r1 = (bsdf_sampleset_ptr && bsdf_sampleset_ptr->bsdf_2d) ? bsdf_sampleset_ptr->bsdf_2d[j * 2] : rng.random();
-		float b_r2 = (bsdf_sampleset_ptr && bsdf_sampleset_ptr->bsdf_2d) ? bsdf_sampleset_ptr->bsdf_2d[j * 2 + 1] : rng.random();
-		float b_c = (bsdf_sampleset_ptr && bsdf_sampleset_ptr->bsdf_1d) ? bsdf_sampleset_ptr->bsdf_1d[j] : rng.random();
-		BSDFSample bsdf_sample(b_r1, b_r2, b_c);
+		draw_direct_samples(light_sampleset_ptr, bsdf_sampleset_ptr, j, rng, light_sample, bsdf_sample);
 		Ld += estimate_direct_light(scene_ptr, scene_ptr->get_lights()[selected], bsdf_ptr, p, n, wo,
 			light_sample, bsdf_sample, rng, BxDFType(BSDF_ALL & ~BSDF_SPECULAR));
 	}
@@ -68,16 +71,33 @@ Color3 uniform_sample_one_light(const Scene *scene_ptr, BSDF *bsdf_ptr, const Ve
 	return L;
 }
 
-Color3 estimate_direct_light(const Scene *scene_ptr, Light* light, BSDF *bsdf_ptr, const Vector3 &p, const Vector3 &n, const Vector3 &wo, 
-								 const LightSample &light_sample, const BSDFSample &bsdf_sample,
-								Random462 &rng, BxDFType flags) {
-	Color3 L = Color3::Black();
+void prepare_one_light(const Scene *scene_ptr, BSDF *bsdf_ptr, const Vector3 &p, const Vector3 &n, const Vector3 &wo, const float light_select,
+								const LightSampleSet *light_sampleset_ptr, const BSDFSampleSet *bsdf_sampleset_ptr,
+								Random462 &rng, DirectLightRays &rays) {
+	int selected = select_light(scene_ptr, light_select, rng);
+	LightSample light_sample(0.f, 0.f, 0.f);
+	BSDFSample bsdf_sample;
+
+	draw_direct_samples(light_sampleset_ptr, bsdf_sampleset_ptr, 0, rng, light_sample, bsdf_sample);
+	prepare_direct_light(scene_ptr, scene_ptr->get_lights()[selected], bsdf_ptr, p, n, wo,
+		light_sample, bsdf_sample, BxDFType(BSDF_ALL & ~BSDF_SPECULAR), rays);
+	rays.shadow_L *= scene_ptr->num_lights();
+	rays.bsdf_weight *= scene_ptr->num_lights();
+}
 
+void prepare_direct_light(const Scene *scene_ptr, Light* light, BSDF *bsdf_ptr, const Vector3 &p, const Vector3 &n, const Vector3 &wo,
+								 const LightSample &light_sample, const BSDFSample &bsdf_sample,
+								BxDFType flags, DirectLightRays &rays) {
 	Vector3 wi;
 	float l_pdf;
 	float b_pdf;
 	VisibilityTest test;
 	Color3 li;
+
+	rays.light = light;
+	rays.has_shadow = false;
+	rays.has_bsdf = false;
+
 	li = light->sample_L(p, light_sample.r1, light_sample.r2, light_sample.c,
 						&wi, &l_pdf, &test);
 
@@ -85,20 +105,20 @@ Color3 estimate_direct_light(const Scene *scene_ptr, Light* light, BSDF *bsdf_pt
 		Color3 f = bsdf_ptr->f(const_cast<Vector3&>(wo), wi, n, flags);
 		b_pdf = bsdf_ptr->pdf(const_cast<Vector3&>(wo), wi, n, flags);
 		if(f != Color3::Black() && b_pdf > 1e-3) {
-			hitRecord h;
-			if (!scene_ptr->hit(test.r, test.t0, test.t1, h, false)) {
-				L += f * li * std::fabs(dot(wi, n)) / l_pdf;
-				if (!light->IsDeltaLight()) {
-					L *= power_heuristic(1, l_pdf, 1, b_pdf);
-				}
-			}
+			rays.has_shadow = true;
+			rays.shadow = test.r;
+			rays.shadow.e = Ray::offset_origin(test.r.e, n, wi);
+			rays.shadow_t0 = test.t0;
+			rays.shadow_t1 = test.t1;
+			rays.shadow_L = f * li * std::fabs(dot(wi, n)) / l_pdf;
+			if (!light->IsDeltaLight())
+				rays.shadow_L *= power_heuristic(1, l_pdf, 1, b_pdf);
 		}
 	}
 
 	BxDFType type;
 	Color3 fi = bsdf_ptr->sample_f(const_cast<Vector3&>(wo), bsdf_sample.r1, bsdf_sample.r2, bsdf_sample.c, &wi, n,
 		&b_pdf, flags, &type);
-	li.r = li.g = li.b = 0.;
 	if (fi != Color3::Black() && b_pdf > 1e-3) {
 		float weight = 1.f;
 
@@ -106,27 +126,56 @@ Color3 estimate_direct_light(const Scene *scene_ptr, Light* light, BSDF *bsdf_pt
 			l_pdf = light->pdf(p, wi);
 			// non-specular + shadow
 			if (l_pdf < 1e-3)
-				return L;
+				return ;
 			weight = power_heuristic(1, b_pdf, 1, l_pdf);
 		}
 
 		// check along wi to see if theres any light
-		Ray ray(p, wi);
-		hitRecord h;
-		if (scene_ptr->hit(ray, 1e-3, BIG_NUMBER, h, true)) {
-			if (h.shape_ptr->light_ptr == (AreaLight*)light) {
-				li = h.shape_ptr->light_ptr->L(h.n, -wi);
+		rays.has_bsdf = true;
+		rays.bsdf = Ray(Ray::offset_origin(p, n, wi), wi);
+		rays.bsdf_weight = fi * std::fabs(dot(wi, n)) * weight / b_pdf;
+	}
+}
+
+Color3 finish_direct_light(const Scene *scene_ptr, const DirectLightRays &rays, bool occluded,
+								bool bsdf_found, hitRecord &bsdf_hit) {
+	Color3 L = Color3::Black();
+
+	if (rays.has_shadow && !occluded)
+		L += rays.shadow_L;
+
+	if (rays.has_bsdf) {
+		Color3 li = Color3::Black();
+		if (bsdf_found) {
+			if (bsdf_hit.shape_ptr->light_ptr == (AreaLight*)rays.light) {
+				scene_ptr->shade_hit(rays.bsdf, bsdf_hit);
+				li = bsdf_hit.shape_ptr->light_ptr->L(bsdf_hit.n, -rays.bsdf.d);
 			}
 		}
 		// for infinite light
 		else
-			li = light->Le(ray);
-		L += fi * li * std::fabs(dot(wi, n)) * weight / b_pdf;
+			li = rays.light->Le(rays.bsdf);
+		L += rays.bsdf_weight * li;
 	}
 
 	return L;
 }
 
+Color3 estimate_direct_light(const Scene *scene_ptr, Light* light, BSDF *bsdf_ptr, const Vector3 &p, const Vector3 &n, const Vector3 &wo, 
+								 const LightSample &light_sample, const BSDFSample &bsdf_sample,
+								Random462 &rng, BxDFType flags) {
+	DirectLightRays rays;
+	prepare_direct_light(scene_ptr, light, bsdf_ptr, p, n, wo, light_sample, bsdf_sample, flags, rays);
+
+	hitRecord h;
+	bool occluded = rays.has_shadow &&
+		scene_ptr->hit(rays.shadow, rays.shadow_t0, rays.shadow_t1, h, false);
+	bool found = rays.has_bsdf &&
+		scene_ptr->hit(rays.bsdf, 1e-3, BIG_NUMBER, h, true);
+
+	return finish_direct_light(scene_ptr, rays, occluded, found, h);
+}
+
 Color3 SpecularTrace(const Scene *scene_ptr, SurfaceIntegrator *int_ptr,
 										Vector3 &wo, const hitRecord &record,
 									const Sample* sample_ptr, Random462 &rng, const BxDFType flags) {
@@ -145,9 +194,10 @@ Color3 SpecularTrace(const Scene *scene_ptr, SurfaceIntegrator *int_ptr,
                                 flags);
 
 	if (pdf > 0.f && f != Color3::Black() && std::fabs(dot(n, wi)) > 1e-3) {
-		Ray r(p, wi);
+		Ray r(Ray::offset_origin(p, n, wi), wi);
 		hitRecord h;
-		scene_ptr->hit(r, 1e-3, BIG_NUMBER, h, true);
+		if (scene_ptr->hit(r, 1e-3, BIG_NUMBER, h, true))
+			scene_ptr->shade_hit(r, h);
 		h.depth = record.depth + 1;
 		L += f * std::fabs(dot(n, wi)) / pdf * int_ptr->li(scene_ptr, r, h, sample_ptr, rng);
 	}
@@ -167,4 +217,10 @@ Color3 SpecularTransmit(const Scene *scene_ptr, SurfaceIntegrator *int_ptr,
 	return SpecularTrace(scene_ptr, int_ptr, wo, record, sample_ptr, rng, BxDFType(BSDF_TRANSMISSION | BSDF_SPECULAR));
 }
 
+void SurfaceIntegrator::li_packet(const Scene *scene_ptr, const Packet &packet, const hitRecord *records,
+						const Sample *const *samples, Random462 *rngs, Color3 *L) {
+	for (uint32_t i = 0; i < packet.size; i++)
+		L[i] = li(scene_ptr, packet.get_ray(i), records[i], samples[i], rngs[i]);
+}
+
 }
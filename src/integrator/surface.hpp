@@ -77,6 +77,23 @@ struct BSDFOffset {
 
 enum LightSamplingMode { SAMPLE_ALL, SAMPLE_ONE };
 
+// The two rays of one direct light estimate, set up before either is
+// traced so whole packets of them can go through the batched hit().
+struct DirectLightRays {
+	Light *light;
+
+	// light sample: counts only if the shadow ray is unoccluded
+	bool has_shadow;
+	Ray shadow;
+	real_t shadow_t0, shadow_t1;
+	Color3 shadow_L;
+
+	// bsdf sample: radiance found along the ray times bsdf_weight
+	bool has_bsdf;
+	Ray bsdf;
+	Color3 bsdf_weight;
+};
+
 class SurfaceIntegrator {
 public:
 	~SurfaceIntegrator() { }
@@ -85,6 +102,11 @@ public:
 
 	virtual Color3 li(const Scene *scene_ptr, const Ray &ray, const hitRecord &record, const Sample* sample_ptr,
 						Random462 &rng) = 0;
+	// li() for every ray of a packet into L; records, samples and rngs are
+	// per ray. Integrators that can share traversals across the packet
+	// override this.
+	virtual void li_packet(const Scene *scene_ptr, const Packet &packet, const hitRecord *records,
+						const Sample *const *samples, Random462 *rngs, Color3 *L);
 	virtual void initialize_sampler(const Scene *scene_ptr, Sampler *sampler_ptr) = 0;
 };
 
@@ -99,6 +121,21 @@ Color3 uniform_sample_one_light(const Scene *scene_ptr, BSDF *bsdf_ptr, const Ve
 								const LightSampleSet* light_sample_ptr, const BSDFSampleSet* bsdf_sample_ptr,
 								Random462 &rng);
 
+// One light sample of uniform_sample_one_light, drawing from rng in the
+// same order; the light count is folded into the weights.
+void prepare_one_light(const Scene *scene_ptr, BSDF *bsdf_ptr, const Vector3 &p, const Vector3 &n, const Vector3 &wo, const float light_select,
+								const LightSampleSet* light_sample_ptr, const BSDFSampleSet* bsdf_sample_ptr,
+								Random462 &rng, DirectLightRays &rays);
+
+void prepare_direct_light(const Scene *scene_ptr, Light* light, BSDF *bsdf_ptr, const Vector3 &p, const Vector3 &n, const Vector3 &wo,
+								 const LightSample &light_sample, const BSDFSample &bsdf_sample,
+								BxDFType flags, DirectLightRays &rays);
+
+// occluded is the any-hit result of rays.shadow; bsdf_hit the closest hit
+// along rays.bsdf, if bsdf_found.
+Color3 finish_direct_light(const Scene *scene_ptr, const DirectLightRays &rays, bool occluded,
+								bool bsdf_found, hitRecord &bsdf_hit);
+
 Color3 estimate_direct_light(const Scene *scene_ptr, Light* light, BSDF *bsdf_ptr, const Vector3 &p, const Vector3 &n, const Vector3 &wo, 
 								 const LightSample &light_sample, const BSDFSample &bsdf_sample,
 								Random462 &rng, BxDFType flags);
@@ -31,9 +31,10 @@ Color3 WhittedIntegrator::SpecularTrace(const Scene *scene_ptr, Vector3 &wo, con
                                 flags);
 
 	if (pdf > 0.f && f != Color3::Black() && std::fabs(dot(n, wi)) > 1e-3) {
-		Ray r(p, wi);
+		Ray r(Ray::offset_origin(p, n, wi), wi);
 		hitRecord h;
-		scene_ptr->hit(r, 1e-3, BIG_NUMBER, h, true);
+		if (scene_ptr->hit(r, 1e-3, BIG_NUMBER, h, true))
+			scene_ptr->shade_hit(r, h);
 		h.depth = record.depth + 1;
 		L += f * std::fabs(dot(n, wi)) / pdf * li(scene_ptr, r, h, sample_ptr, rng);
 	}
@@ -76,15 +77,23 @@ Color3 WhittedIntegrator::li(const Scene *scene_ptr, const Ray &ray, const hitRe
 		return L;
 	}
 
-    // Add contribution of each light source
+    // Add contribution of each light source. The shadow rays toward one
+    // light are traced together as a packet culled by a frustum to the light.
     for (uint32_t i = 0; i < scene_ptr->num_lights(); ++i) {
-		Color3 Ld = Color3::Black();
-		for (uint32_t j = 0; j < scene_ptr->get_lights()[i]->num_samples; j++) {
+		Light *light_ptr = scene_ptr->get_lights()[i];
+		FrameArena& arena = FrameArena::local();
+		FrameArena::Scope scope(arena);
+		Packet shadow(light_ptr->num_samples);
+		Color3* unoccluded = arena.alloc<Color3>(light_ptr->num_samples);
+		uint32_t count = 0;
+		float t0 = 0.f, t1 = 1.f;
+
+		for (uint32_t j = 0; j < light_ptr->num_samples; j++) {
 			Vector3 wi;
 			float pdf;
 			VisibilityTest visibility;
 
-			Color3 Li = scene_ptr->get_lights()[i]->sample_L(p, 
+			Color3 Li = light_ptr->sample_L(p, 
 				rng.random(), rng.random(), rng.random(),
 				&wi, &pdf, &visibility);
 
@@ -94,14 +103,42 @@ Color3 WhittedIntegrator::li(const Scene *scene_ptr, const Ray &ray, const hitRe
 			Color3 f = Color3::Black();
 			if (bsdf_ptr)
 				f = bsdf_ptr->f(wo, wi, n);
-			hitRecord h;
-			if (!(f == Color3::Black()) &&
-				!scene_ptr->hit(visibility.r, visibility.t0, visibility.t1, h, false)) {
-				float abscos = std::fabs(dot(wi, n));
-				Ld += f * Li * abscos / pdf;
+			if (f == Color3::Black())
+				continue;
+
+			float abscos = std::fabs(dot(wi, n));
+			Ray shadow_ray(Ray::offset_origin(visibility.r.e, n, wi), visibility.r.d);
+			// the packet takes the range of its first sample; one that
+			// asks for another range is tested on its own
+			if (count == 0) {
+				t0 = visibility.t0;
+				t1 = visibility.t1;
+			}
+			else if (visibility.t0 != t0 || visibility.t1 != t1) {
+				hitRecord h;
+				if (!scene_ptr->hit(shadow_ray, visibility.t0, visibility.t1, h, false))
+					L += f * Li * abscos / pdf / light_ptr->num_samples;
+				continue;
 			}
+			unoccluded[count] = f * Li * abscos / pdf;
+			shadow.set_ray(count++, shadow_ray.e, shadow_ray.d);
+		}
+
+		shadow.size = count;
+		shadow.finalize();
+		BoundingBox light_bounds;
+		if (light_ptr->get_bounds(&light_bounds))
+			shadow.build_shadow_frustum(light_bounds);
+
+		hitRecord* hs = arena.alloc<hitRecord>(count);
+		scene_ptr->hit(shadow, t0, t1, hs, false);
+
+		Color3 Ld = Color3::Black();
+		for (uint32_t j = 0; j < count; j++) {
+			if (hs[j].t < 0)
+				Ld += unoccluded[j];
 		}
-		L += Ld / scene_ptr->get_lights()[i]->num_samples;
+		L += Ld / light_ptr->num_samples;
     }
 
     if (record.depth + 1 < max_depth) {
@@ -40,6 +40,11 @@ float AreaLight::pdf(const Vector3 &p, const Vector3 &wi) const {
 	return geo_ptr->pdf(p, wi);
 }
 
+bool AreaLight::get_bounds(BoundingBox *bb_ptr) const {
+	*bb_ptr = geo_ptr->bb;
+	return true;
+}
+
 void AreaLight::initialize_sampler(Sampler *sampler_ptr, LightOffset &offset) const {
 	offset.num = num_samples;
 	offset.offset_1d = sampler_ptr->add1D(num_samples);
@@ -22,6 +22,7 @@ public:
 	bool IsDeltaLight() const { return false; }
     float pdf(const Vector3 &p, const Vector3 &wi) const;
 	Color3 L(const Vector3 &n, const Vector3 &wi) const;
+	bool get_bounds(BoundingBox *bb_ptr) const;
 	void initialize_sampler(Sampler *sampler_ptr, LightOffset &offset) const;
 	Color3 l;
 
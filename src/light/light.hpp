@@ -11,6 +11,7 @@ class Scene;
 struct LightOffset;
 class Sampler;
 class Ray;
+class BoundingBox;
 struct VisibilityTest;
 
 class Light {
@@ -37,6 +38,12 @@ public:
 
     virtual float pdf(const Vector3 &p, const Vector3 &wi) const = 0;
 
+	// World bounds of the points sample_L can return, used to build shadow
+	// frustums. Returns false for lights without finite extent.
+	virtual bool get_bounds(BoundingBox *) const {
+		return false;
+	}
+
     // Light Public Data
     int num_samples;
 protected:
@@ -28,4 +28,10 @@ float PointLight::pdf(const Vector3 &p, const Vector3 &wi) const {
 	return 0.f;
 }
 
+bool PointLight::get_bounds(BoundingBox *bb_ptr) const {
+	*bb_ptr = BoundingBox();
+	bb_ptr->AddPoint(position);
+	return true;
+}
+
 }
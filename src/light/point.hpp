@@ -22,6 +22,7 @@ public:
     Color3 Power(const Scene *scene) const;
 	bool IsDeltaLight() const { return true; }
     float pdf(const Vector3 &p, const Vector3 &wi) const;
+	bool get_bounds(BoundingBox *bb_ptr) const;
 
 protected:
     Color3 intensity;
@@ -0,0 +1,56 @@
+#include "math/arena.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <malloc.h>
+
+namespace _462 {
+
+#ifdef _WINDOWS
+    #define memalign(a,b) _aligned_malloc((b),(a))
+#else
+    #define _aligned_free(a) free((a))
+#endif
+
+FrameArena::FrameArena() : block(0), offset(0) { }
+
+FrameArena::~FrameArena()
+{
+    for (size_t i = 0; i < blocks.size(); i++)
+        _aligned_free(blocks[i]);
+}
+
+void* FrameArena::alloc_bytes(size_t bytes)
+{
+    bytes = (bytes + 15) & ~(size_t)15;
+
+    // blocks left behind by a rewind are reused before new ones are made
+    while (block < blocks.size() && offset + bytes > sizes[block]) {
+        block++;
+        offset = 0;
+    }
+    if (block == blocks.size()) {
+        size_t size = std::max((size_t)BLOCK_SIZE, bytes);
+        blocks.push_back((char*)memalign(16, size));
+        sizes.push_back(size);
+    }
+
+    void* p = blocks[block] + offset;
+    offset += bytes;
+    return p;
+}
+
+void FrameArena::reset()
+{
+    block = 0;
+    offset = 0;
+}
+
+FrameArena& FrameArena::local()
+{
+    // One per thread rather than per OpenMP thread number, so nested
+    // parallel regions and threads outside OpenMP get arenas of their own.
+    static thread_local FrameArena arena;
+    return arena;
+}
+
+} /* _462 */
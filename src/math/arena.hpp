@@ -0,0 +1,75 @@
+#ifndef _462_MATH_ARENA_HPP_
+#define _462_MATH_ARENA_HPP_
+
+#include "math/math.hpp"
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace _462 {
+
+/**
+ * Per-thread bump allocator for render-time scratch: packets, hit records
+ * and kernel outputs. Memory is only handed back by rewinding, either with
+ * reset() at the start of a tile or with a Scope around short-lived
+ * buffers. Blocks are kept across tiles, so a warmed-up arena never goes
+ * back to malloc.
+ */
+class FrameArena
+{
+public:
+    FrameArena();
+    ~FrameArena();
+
+    // Room for n default-initialized objects of T, 16 byte aligned. Nothing
+    // is destroyed on rewind, so T must be trivially destructible.
+    template <typename T>
+    T* alloc(size_t n)
+    {
+        T* p = (T*)alloc_bytes(sizeof(T) * n);
+        for (size_t i = 0; i < n; i++)
+            new (p + i) T;
+        return p;
+    }
+    void* alloc_bytes(size_t bytes);
+
+    // Releases every allocation; the blocks stay with the arena.
+    void reset();
+
+    // Rewinds the arena to where it was when the scope was opened.
+    class Scope
+    {
+    public:
+        Scope(FrameArena& arena) :
+            arena(arena), block(arena.block), offset(arena.offset) { }
+        ~Scope() {
+            arena.block = block;
+            arena.offset = offset;
+        }
+
+    private:
+        FrameArena& arena;
+        size_t block, offset;
+
+        Scope(const Scope&);
+        Scope& operator=(const Scope&);
+    };
+
+    // The arena of the calling thread.
+    static FrameArena& local();
+
+private:
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    std::vector<char*> blocks;
+    std::vector<size_t> sizes;
+    // block in use and the first free byte in it
+    size_t block, offset;
+
+    FrameArena(const FrameArena&);
+    FrameArena& operator=(const FrameArena&);
+};
+
+} /* _462 */
+
+#endif /* _462_MATH_ARENA_HPP_ */
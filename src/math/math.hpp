@@ -15,7 +15,11 @@
 namespace _462 {
 
 // floating point precision set by this typedef
+#ifdef REAL_FLOAT
+typedef float real_t;
+#else
 typedef double real_t;
+#endif
 
 typedef unsigned int uint32_t;
 typedef unsigned char uint8_t;
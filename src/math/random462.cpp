@@ -1,77 +1,53 @@
-
 #include "math/random462.hpp"
+#include <stdint.h>
+#include <cmath>
 
 namespace _462 {
 
-#define M 397
-#define MATRIX_A 0x9908b0dfUL   /* constant vector a */
-#define UPPER_MASK 0x80000000UL /* most significant w-r bits */
-#define LOWER_MASK 0x7fffffffUL /* least significant r bits */
+// Philox-2x32 with 10 rounds (Salmon et al. 2011): encrypts the counter
+// ctr with key.
+static inline uint32_t philox2x32(uint32_t ctr0, uint32_t ctr1, uint32_t key) {
+    for (int round = 0; round < 10; round++) {
+	uint64_t prod = (uint64_t)0xd256d193U * ctr0;
+	uint32_t hi = (uint32_t)(prod >> 32), lo = (uint32_t)prod;
+	ctr0 = hi ^ key ^ ctr1;
+	ctr1 = lo;
+	key += 0x9e3779b9U;
+    }
+    return ctr0;
+}
+
+static inline float to_unit(uint32_t v) {
+    return (v & 0xffffff) / float(1 << 24);
+}
 
 void Random462::seed(uint32_t seed) const {
-    mt[0]= seed & 0xffffffffUL;
-    for (mti=1; mti<N; mti++) {
-        mt[mti] =
-        (1812433253UL * (mt[mti-1] ^ (mt[mti-1] >> 30)) + mti);
-        /* See Knuth TAOCP Vol2. 3rd Ed. P.106 for multiplier. */
-        /* In the previous versions, MSBs of the seed affect   */
-        /* only MSBs of the array mt[].                        */
-        /* 2002/01/09 modified by Makoto Matsumoto             */
-        mt[mti] &= 0xffffffffUL;
-        /* for >32 bit machines */
-    }
+    this->seed(seed, 0);
 }
 
+void Random462::seed(uint32_t pixel, uint32_t sample) const {
+    key = pixel;
+    stream = sample;
+    counter = 0;
+}
 
 /* generates a random number on [0,1)-real-interval */
 float Random462::random() const
 {
-    float v = (random_int() & 0xffffff) / float(1 << 24);
-    return v;
+    return to_unit(random_int());
 }
 
-
-
-// Random Number Functions
 uint32_t Random462::random_int() const
 {
-    unsigned long y;
-    static unsigned long mag01[2]={0x0UL, MATRIX_A};
-    /* mag01[x] = x * MATRIX_A  for x=0,1 */
-
-#pragma omp critical
-	{
-		if (mti >= N) { /* generate N words at one time */
-			int kk;
-
-			if (mti == N+1)   /* if Seed() has not been called, */
-				seed(5489UL); /* default initial seed */
-
-			for (kk=0;kk<N-M;kk++) {
-				y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
-				mt[kk] = mt[kk+M] ^ (y >> 1) ^ mag01[y & 0x1UL];
-			}
-			for (;kk<N-1;kk++) {
-				y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
-				mt[kk] = mt[kk+(M-N)] ^ (y >> 1) ^ mag01[y & 0x1UL];
-			}
-			y = (mt[N-1]&UPPER_MASK)|(mt[0]&LOWER_MASK);
-			mt[N-1] = mt[M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
-
-			mti = 0;
-		}
-
-		y = mt[mti++];
-	}
-
-    /* Tempering */
-    y ^= (y >> 11);
-    y ^= (y << 7) & 0x9d2c5680UL;
-    y ^= (y << 15) & 0xefc60000UL;
-    y ^= (y >> 18);
+    return philox2x32(counter++, stream, key);
+}
 
-    return y;
+real_t Random462::gaussian() const
+{
+    // Box-Muller
+    real_t u1 = 1 - random();
+    real_t u2 = random();
+    return std::sqrt(-2 * std::log(u1)) * std::cos(2 * PI * u2);
 }
 
 } /* _462 */
-
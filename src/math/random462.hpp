@@ -1,47 +1,38 @@
-
 #ifndef _462_RANDOM462_HPP_
 #define _462_RANDOM462_HPP_
 
 #include "math/math.hpp"
-#include <random>
 
 namespace _462{
 
+/**
+ * Counter-based random numbers (Philox-2x32-10). The n-th number of a
+ * stream is a pure function of (key, stream, n), so a generator keyed by
+ * pixel and sample draws the same values on any thread in any order, and
+ * generators never share state. Give each thread, or better each sample,
+ * its own instance.
+ */
 class Random462 {
 public:
 	Random462(uint32_t seed = 5489UL) {
-		mti = N+1;
 		this->seed(seed);
 	}
+	// The stream for sample `sample` of pixel `pixel`; the n-th draw is
+	// its dimension n.
+	Random462(uint32_t pixel, uint32_t sample) {
+		seed(pixel, sample);
+	}
 
 	void seed(uint32_t seed) const;
+	void seed(uint32_t pixel, uint32_t sample) const;
     float random() const;
 	uint32_t random_int() const;
+	// A draw from N(0, 1); takes two dimensions.
+	real_t gaussian() const;
 
 private:
-    static const int N = 624;
-    mutable unsigned long mt[N]; /* the array for the state vector  */
-    mutable int mti;
+    mutable uint32_t key, stream, counter;
 };
-    /**
-     * Generate a uniform random real_t on the interval [0, 1)
-     */
-    inline real_t random_uniform()
-    {
-        return real_t(rand())/RAND_MAX;
-    }
-
-    /**
-     * Generate a uniform random real_t from N(0, 1)
-     */
-    inline real_t random_gaussian()
-    {
-        static std::default_random_engine generator;
-        static std::normal_distribution<real_t> dist =
-            std::normal_distribution<real_t>();
-        return dist(generator);
-    }
-
 
 }; // _462
 
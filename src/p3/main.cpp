@@ -509,7 +509,7 @@ static void print_usage( const char* progname )
 {
     std::cout << "Usage: " << progname <<
 	"input_scene [-n num_samples] [-r] [-d width"
-	" height] [-o output_file] [-t number of threads] [-x width of work] [-r ray width in a packet]\n"
+	" height] [-o output_file] [-t number of threads] [-x width of work] [-r ray width in a packet] [-f] [-q sampler] [-k passes] [-e noise target] [-b seconds]\n"
         "\n" \
         "Options:\n" \
         "\n" \
@@ -519,6 +519,24 @@ static void print_usage( const char* progname )
         "\t-d width height\n" \
         "\t\tThe dimensions of image to raytrace (and window if using\n" \
         "\t\tand opengl context. Defaults to width=800, height=600.\n" \
+        "\t-f:\n" \
+        "\t\tImportance samples the reconstruction filter, so every sample\n" \
+        "\t\tcounts toward a single pixel.\n" \
+        "\t-q sampler:\n" \
+        "\t\tThe sample generator: halton (default), sobol, bluenoise,\n" \
+        "\t\tstratified or random. bluenoise spreads the error of low\n" \
+        "\t\tsample count previews into high frequency noise.\n" \
+        "\t-k passes:\n" \
+        "\t\tAdaptive sampling: after the first pass, up to passes - 1\n" \
+        "\t\tmore passes of num_samples are spent on packets whose\n" \
+        "\t\trelative error is above the noise target. Defaults to 1.\n" \
+        "\t-e noise target:\n" \
+        "\t\tRelative error at which a pixel, and the whole image,\n" \
+        "\t\tcounts as converged. Defaults to 0.01.\n" \
+        "\t-b seconds:\n" \
+        "\t\tStops adaptive passes after this much render time. The\n" \
+        "\t\tfirst pass always completes, and work tiles already\n" \
+        "\t\tstarted are finished.\n" \
         "\t-s input_scene:\n" \
         "\t\tThe scene file to load and raytrace.\n" \
         "\toutput_file:\n" \
@@ -564,6 +582,11 @@ static bool parse_args( Options* opt, int argc, char* argv[] )
 	opt->sample_depth = 3;
 	opt->max_depth = 5;
 	opt->num_per_path = 1;
+	opt->filter_sampling = false;
+	opt->sampler_name = "halton";
+	opt->max_passes = 1;
+	opt->noise_target = 0.01f;
+	opt->time_budget = 0;
 
 	for (int i = 2; i < argc; i++)
 	{
@@ -620,6 +643,25 @@ static bool parse_args( Options* opt, int argc, char* argv[] )
 		    if (i < argc - 1)
 				opt->num_per_path = atoi(argv[++i]);
 		    break;
+		case 'f':
+		    opt->filter_sampling = true;
+		    break;
+		case 'q':
+		    if (i < argc - 1)
+				opt->sampler_name = argv[++i];
+		    break;
+		case 'k':
+		    if (i < argc - 1)
+				opt->max_passes = atoi(argv[++i]);
+		    break;
+		case 'e':
+		    if (i < argc - 1)
+				opt->noise_target = atof(argv[++i]);
+		    break;
+		case 'b':
+		    if (i < argc - 1)
+				opt->time_budget = atof(argv[++i]);
+		    break;
 		}
 	}
 
@@ -23,6 +23,7 @@
 #include <random>
 #include <time.h>
 #include <vector>
+#include <cstring>
 #include <omp.h>
 
 using namespace std;
@@ -88,6 +89,23 @@ namespace _462 {
 	film_ptr = NULL;
     }
 
+    // Sampler named by the -q option.
+    static Sampler *create_sampler(const char *name, uint32_t width, uint32_t height,
+				   uint32_t packet_width_x, uint32_t packet_width_y,
+				   uint32_t num_samples) {
+	if (strcmp(name, "sobol") == 0)
+	    return new SobolSampler(width, height, packet_width_x, packet_width_y, num_samples);
+	if (strcmp(name, "bluenoise") == 0)
+	    return new SobolSampler(width, height, packet_width_x, packet_width_y, num_samples, true);
+	if (strcmp(name, "stratified") == 0)
+	    return new StratifiedSampler(width, height, packet_width_x, packet_width_y, num_samples);
+	if (strcmp(name, "random") == 0)
+	    return new RandomSampler(width, height, packet_width_x, packet_width_y, num_samples);
+	if (strcmp(name, "halton") != 0)
+	    printf("Unknown sampler %s, using halton\n", name);
+	return new HaltonSampler(width, height, packet_width_x, packet_width_y, num_samples);
+    }
+
     /**
     * Initializes the raytracer for the given scene. Overrides any previous
     * initializations. May be invoked before a previous raytrace completes.
@@ -154,8 +172,8 @@ namespace _462 {
 	printf("ray: %d; #sam: %d; x: %d; y: %d\n", this->packet_width_ray,
 	       this->num_samples, this->packet_width_x, this->packet_width_y);
 
-	sampler_ptr = new HaltonSampler(this->width, this->height, this->packet_width_x,
-					    this->packet_width_y, this->num_samples);
+	sampler_ptr = create_sampler(opt_ptr->sampler_name, this->width, this->height,
+				     this->packet_width_x, this->packet_width_y, this->num_samples);
 	
 	
 	film_ptr = new Film(this->width,
@@ -163,6 +181,7 @@ namespace _462 {
 			    padding_x, width + padding_x,
 			    padding_y, height + padding_y);
 	film_ptr->setFilter(filter_ptr);
+	film_ptr->setFilterSampling(opt_ptr->filter_sampling);
 
         return true;
     }
@@ -196,6 +215,7 @@ namespace _462 {
         {
             // pick a point within the pixel boundaries to fire our
             // ray through.
+            Random462 rng(y * width + x, iter);
             real_t i = real_t(2)*(real_t(x)+ rng.random())*dx - real_t(1);
             real_t j = real_t(2)*(real_t(y)+ rng.random())*dy - real_t(1);
 
@@ -203,7 +223,7 @@ namespace _462 {
             std::vector<real_t> refractiveStack;
             refractiveStack.push_back(scene->refractive_index);
 
-            res += scene->getColor(r, refractiveStack);
+            res += scene->getColor(r, rng, refractiveStack);
         }
         return res*(real_t(1)/num_samples);
     }
@@ -223,10 +243,18 @@ namespace _462 {
             frustum.planes[BACK].point = eye + gaze * 
                 scene->camera.get_far_clip();
 
-            Vector3 low_left = get_viewing_ray(xmin, ymin);
-            Vector3 low_right = get_viewing_ray(xmax, ymin);
-            Vector3 up_left = get_viewing_ray(xmin, ymax);
-            Vector3 up_right = get_viewing_ray(xmax, ymax);
+            // Use the same mapping as the packet rays, widened by a hair so
+            // float rounding of the ray streams can't leave the frustum.
+            const real_t slack = 1e-3;
+            real_t l = real_t(2) * (xmin - slack) / width - real_t(1);
+            real_t r = real_t(2) * (xmax + slack) / width - real_t(1);
+            real_t b = real_t(2) * (ymin - slack) / height - real_t(1);
+            real_t t = real_t(2) * (ymax + slack) / height - real_t(1);
+
+            Vector3 low_left = Ray::get_pixel_dir(l, b);
+            Vector3 low_right = Ray::get_pixel_dir(r, b);
+            Vector3 up_left = Ray::get_pixel_dir(l, t);
+            Vector3 up_right = Ray::get_pixel_dir(r, t);
 
             frustum.planes[TOP].norm = cross(up_left, up_right);
             frustum.planes[BOTTOM].norm = cross(low_right, low_left);
@@ -238,32 +266,8 @@ namespace _462 {
             frustum.isValid = true;
     }
 
-    // calculate direction of initial viewing ray from camera
-    Vector3 Raytracer::get_viewing_ray(size_t x, size_t y) {
-        // normalized camera direction
-        Vector3 gaze = scene->camera.get_direction();
-        // normalized camera up direction
-        Vector3 up = scene->camera.get_up();
-        // normalized camera right direction
-        Vector3 right = cross(gaze, up);
-        // camera field of view
-        float fov = scene->camera.get_fov_radians();
-        // t, b, r, and l are the border disances of the image plane
-        real_t t = tan((width / height) * fov / 2.0);
-        real_t r = (t * width) / height;
-        real_t b = -1.0 * t;
-        real_t l = -1.0 * r;
-        // the pixel's horizontal coordinate on image plane
-        real_t u = l + (r - l) * (x + 0.5) / width;
-        // the pixel's vertical coordinate on image plane
-        real_t v = b + (t - b) * (y + 0.5) / height;
-        // Shirley uses the near plane for the below calculation; we'll just use 1
-        Vector3 view_ray = gaze + (u * right) + (v * up);
-
-        return view_ray; // viewing ray direction
-    }
-
-    void Raytracer::build_packet(size_t x, size_t y, size_t width, size_t height, Packet& packet) {
+    void Raytracer::build_packet(size_t x, size_t y, size_t width, size_t height, Packet& packet,
+				 Random462* rngs, size_t packet_index) {
         real_t dx = real_t(1)/width;
         real_t dy = real_t(1)/height;
         size_t x_min;
@@ -285,20 +289,14 @@ namespace _462 {
                 for (size_t iter = 0; iter < iterations; iter++) {
                     // pick a point within the pixel boundaries to fire our
                     // ray through.
+                    Random462& rng = rngs[count];
+                    rng.seed(cur_y * width + cur_x, packet_index * iterations + iter);
                     real_t rand_i = real_t(2)*(real_t(cur_x)+ rng.random())*dx - real_t(1);
                     real_t rand_j = real_t(2)*(real_t(cur_y)+ rng.random())*dy - real_t(1);
 
                     Ray r = Ray(scene->camera.get_position(), Ray::get_pixel_dir(rand_i, rand_j));
 
-                    // TODO: a better way?
-                    packet.e_x[count] = r.e[0];
-                    packet.e_y[count] = r.e[1];
-                    packet.e_z[count] = r.e[2];
-                    packet.d_x[count] = r.d[0];
-                    packet.d_y[count] = r.d[1];
-                    packet.d_z[count] = r.d[2];
-
-                    packet.rays[count++] = r;
+                    packet.set_ray(count++, r.e, r.d);
                 }
             }
         }
@@ -310,6 +308,7 @@ namespace _462 {
         build_frustum(packet.frustum, x_min, x_max, y_min, y_max);
 
         packet.size = packet_width_ray * packet_width_ray;
+        packet.finalize();
     }
 
     void Raytracer::trace_small_packet(unsigned char* buffer,
@@ -333,13 +332,15 @@ namespace _462 {
                         if ((p_x) >= width || (p_y) >= height)
                             continue;
 
+                        FrameArena::local().reset();
                         Color3 cur_color = Color3::Black();
-                        Color3* packet_color = new Color3[packet_ray_size];
+                        Color3* packet_color = FrameArena::local().alloc<Color3>(packet_ray_size);
+                        Random462* rngs = FrameArena::local().alloc<Random462>(packet_ray_size);
 
                         // Shoot packet one by one to the same pixel
                         for (size_t i = 0; i < num_packet; i++) {
                             Packet packet(packet_width_ray * packet_width_ray);
-                            build_packet(p_x, p_y, width, height, packet);
+                            build_packet(p_x, p_y, width, height, packet, rngs, i);
 
                             // Get color
 			    std::vector< std::vector<real_t> > refractiveStack;
@@ -350,7 +351,7 @@ namespace _462 {
                                 refractiveStack.push_back(rstack);
                             }
 
-                            scene->getColors(packet, refractiveStack, packet_color);
+                            scene->getColors(packet, rngs, refractiveStack, packet_color);
 
                             for (size_t count = 0; count < packet_ray_size; count++) 
                                 cur_color += packet_color[count];
@@ -363,9 +364,9 @@ namespace _462 {
             }
     }
 
-    void Raytracer::build_packet_sampler(size_t width, size_t height, Packet& packet,
-					 Sample *&samples,
-					 size_t &p_x, size_t &p_y, Random462 &rng) {
+    void Raytracer::build_packet_sampler(size_t width, size_t height, uint32_t packet_num,
+					 Packet& packet, Sample *&samples, Random462 *&rngs,
+					 size_t &p_x, size_t &p_y) {
         size_t x_min;
         size_t x_max;
         size_t y_min;
@@ -377,7 +378,8 @@ namespace _462 {
 		float dx = float(1)/width;
 		float dy = float(1)/height;
 
-		samples = sampler_ptr->getPacketSamples(temp_x, temp_y, rng);
+		samples = sampler_ptr->getPacketSamples(packet_num, temp_x, temp_y);
+		rngs = FrameArena::local().alloc<Random462>(packet_width_x * packet_width_y * num_samples);
 
 		p_x = temp_x;
 		p_y = temp_y;
@@ -393,20 +395,17 @@ namespace _462 {
                     // ray through.
 					float *pos_samples = (float*)samples + (j * packet_width_x * num_samples + 
 						i * num_samples + iter) * sampler_ptr->get_sample_size();
-					float rand_i = 2.f * pos_samples[0] * dx - 1.f;
-					float rand_j = 2.f * pos_samples[1] * dy - 1.f;
+					Sample pos = *(Sample*)pos_samples;
+					if (film_ptr->filterSampling())
+						pos = film_ptr->warpSample(pos);
+					float rand_i = 2.f * pos.x * dx - 1.f;
+					float rand_j = 2.f * pos.y * dy - 1.f;
 
                     Ray r = Ray(scene->camera.get_position(), Ray::get_pixel_dir(rand_i, rand_j));
 
-                    // TODO: a better way?
-                    packet.e_x[count] = r.e[0];
-                    packet.e_y[count] = r.e[1];
-                    packet.e_z[count] = r.e[2];
-                    packet.d_x[count] = r.d[0];
-                    packet.d_y[count] = r.d[1];
-                    packet.d_z[count] = r.d[2];
-
-                    packet.rays[count++] = r;
+                    // one stream per sample, whichever thread traces it
+                    rngs[count].seed((p_y + j) * width + p_x + i, sampler_ptr->get_first_sample() + iter);
+                    packet.set_ray(count++, r.e, r.d);
                 }
             }
         }
@@ -418,19 +417,121 @@ namespace _462 {
         build_frustum(packet.frustum, x_min, x_max, y_min, y_max);
 
         packet.size = count;
+        packet.finalize();
     }
 
-	void Raytracer::trace_packet_integrator(SurfaceIntegrator *integrator_ptr, size_t width, size_t height) {
-		uint32_t wanted_packet_num = (width + packet_width_x - 1) / packet_width_x * 
-	    ((height + packet_width_y - 1) / packet_width_y);
-		// TODO : rng array for multi-threading
-		Random462 rng;
+	void Raytracer::addPacketSamples(FilmTile &tile, const Sample *samples, const Color3 *packet_color,
+					 size_t width, size_t height, size_t p_x, size_t p_y) {
+		uint32_t sample_size = sampler_ptr->get_sample_size();
+		size_t valid_x = std::min((size_t)packet_width_x, width - std::min(width, p_x));
+
+		// In-bounds pixels of a row are a prefix of it, so each row is
+		// one contiguous batch.
+		for (size_t y = 0; y < packet_width_y && p_y + y < height; y++) {
+			uint32_t offset = y * packet_width_x * num_samples;
+			tile.addSamples((const Sample*)((const float*)samples + offset * sample_size),
+					packet_color + offset, valid_x * num_samples, sample_size);
+		}
+	}
+
+	void Raytracer::trace_adaptive(SurfaceIntegrator *integrator_ptr, size_t width, size_t height) {
+		time_t start_time = SDL_GetTicks();
+		// later passes stop taking work tiles here; pass 0 always completes
+		uint32_t deadline = 0;
+		if (opt_ptr->time_budget > 0)
+			deadline = start_time + (uint32_t)(opt_ptr->time_budget * 1000);
+
+		sampler_ptr->startPass(0);
+		trace_packet_integrator(integrator_ptr, width, height);
+
+		for (int pass = 1; pass < opt_ptr->max_passes; pass++) {
+			float error = film_ptr->meanError();
+			float elapsed = (SDL_GetTicks() - start_time) / 1000.f;
+			if (error <= opt_ptr->noise_target)
+				break;
+			if (opt_ptr->time_budget > 0 && elapsed >= opt_ptr->time_budget)
+				break;
+
+			sampler_ptr->startPass(pass);
+			trace_packet_integrator(integrator_ptr, width, height, opt_ptr->noise_target, deadline);
+		}
+	}
+
+	void Raytracer::trace_integrator_packet(SurfaceIntegrator *integrator_ptr, size_t width, size_t height,
+						uint32_t packet_num, FilmTile &tile) {
+		// All numbers should have been rounded
+		size_t p_x;
+		size_t p_y;
+
+		// Clamped along the boundary.
+		Packet packet(packet_width_ray * packet_width_ray);
+		Sample *samples;
+		Random462 *rngs;
+
+		build_packet_sampler(width, height, packet_num, packet, samples, rngs, p_x, p_y);
+
+		hitRecord* hs = FrameArena::local().alloc<hitRecord>(packet.size);
+		scene->hit(packet, 0.f, BIG_NUMBER, hs, true);
+		scene->shade_hit(packet, hs);
+
+		Color3* packet_color = FrameArena::local().alloc<Color3>(packet_width_x * packet_width_y * num_samples);
+		Color3* ray_color = FrameArena::local().alloc<Color3>(packet.size);
+		const Sample** ray_samples = FrameArena::local().alloc<const Sample*>(packet.size);
+		uint32_t* ray_offsets = FrameArena::local().alloc<uint32_t>(packet.size);
+
+		// rays are packed over the in-bounds pixels, samples and colors
+		// laid out over the whole packet
+		size_t count = 0;
+		for (size_t y = 0; y < packet_width_y; y++) {
+			for (size_t x = 0; x < packet_width_x; x++) {
+
+				if ((p_x + x) >= width || (p_y + y) >= height)
+					continue;
+
+				for (size_t iter = 0; iter < num_samples; iter++) {
+					uint32_t offset = y * packet_width_x * num_samples +
+						x * num_samples + iter;
+					hs[count].depth = 0;
+					ray_offsets[count] = offset;
+					ray_samples[count++] = (const Sample*)((float*)samples + offset * sampler_ptr->get_sample_size());
+				}
+			}
+		}
+
+		integrator_ptr->li_packet(scene, packet, hs, ray_samples, rngs, ray_color);
+
+		for (size_t i = 0; i < packet.size; i++)
+			packet_color[ray_offsets[i]] = ray_color[i];
+		addPacketSamples(tile, samples, packet_color, width, height, p_x, p_y);
+	}
 
+	void Raytracer::trace_packet_integrator(SurfaceIntegrator *integrator_ptr, size_t width, size_t height,
+						float threshold, uint32_t deadline) {
+		// work tiles are whole packets, about pixel_width on a side
+		uint32_t packets_x = std::max(1u, pixel_width / packet_width_x);
+		uint32_t packets_y = std::max(1u, pixel_width / packet_width_y);
+		uint32_t work_num_x = (sampler_ptr->p_count_x + packets_x - 1) / packets_x;
+		uint32_t work_num_y = (sampler_ptr->p_count_y + packets_y - 1) / packets_y;
+		uint32_t wanted_work_num = work_num_x * work_num_y;
+		std::vector<FilmApron> aprons(wanted_work_num);
 		time_t prev_time = -1;
 		time_t this_time;
 
-#pragma omp parallel for num_threads(8)
-		for (int i = 0; i < wanted_packet_num; i++) {
+		// Error of every packet before the pass. The film changes under
+		// the pass, so packets are judged on this snapshot alone.
+		std::vector<float> packet_errors;
+		if (threshold > 0) {
+			packet_errors.resize(sampler_ptr->getPacketCount());
+#pragma omp parallel for num_threads(num_threads)
+			for (int i = 0; i < (int)packet_errors.size(); i++) {
+				uint32_t x, y;
+				sampler_ptr->getPacketOrigin(i, x, y);
+				packet_errors[i] = film_ptr->tileError(x, x + packet_width_x, y, y + packet_width_y);
+			}
+		}
+
+#pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+		for (int i = 0; i < wanted_work_num; i++) {
 			int tid = omp_get_thread_num();
 
 			if (tid == 0) {
@@ -439,92 +540,112 @@ namespace _462 {
 					if (prev_time < 0)
 						printf("Rendering: ");
 					prev_time = this_time;
-					printf("%f\%\n", (float)i / wanted_packet_num * 100);
+					printf("%f\%\n", (float)i / wanted_work_num * 100);
 				}
 			}
 
-		   // All numbers should have been rounded
-		   size_t p_x;
-		   size_t p_y;
-
-		   // Clamped along the boundary.
-		   Packet packet(packet_width_ray * packet_width_ray);
-		   Sample *samples;
-
-		   build_packet_sampler(width, height, packet, samples, p_x, p_y, rng);
-
-		   vector<hitRecord> hs(packet.size);
-		   scene->hit(packet, 0.f, BIG_NUMBER, hs, true);
-		   
-		   for (size_t y = 0; y < packet_width_y; y++) {
-			   for (size_t x = 0; x < packet_width_x; x++) {
-
-			   if ((p_x + x) >= width || (p_y + y) >= height)
-				   continue;
-
-			   for (size_t count = 0; count < num_samples; count++) {
-					   uint32_t offset = y * packet_width_x * num_samples +
-					   x * num_samples + count;
-					   hs[offset].depth = 0;
-					   float* start = (float*)samples + offset * sampler_ptr->get_sample_size();
-
-					   Color3 color = integrator_ptr->li(scene, packet.rays[offset], hs[offset], (Sample*)start, rng);
-					   film_ptr->addSample(*(Sample*)start, color);
-				   }
+		   // out of time: the rest of the pass is dropped, tile by tile
+		   if (deadline > 0 && SDL_GetTicks() >= deadline)
+			   continue;
+
+		   // packets [packet_x0, packet_x1) x [packet_y0, packet_y1)
+		   uint32_t work_y = i / work_num_x;
+		   uint32_t work_x = i - work_y * work_num_x;
+		   uint32_t packet_x0 = work_x * packets_x;
+		   uint32_t packet_x1 = std::min(packet_x0 + packets_x, sampler_ptr->p_count_x);
+		   uint32_t packet_y0 = work_y * packets_y;
+		   uint32_t packet_y1 = std::min(packet_y0 + packets_y, sampler_ptr->p_count_y);
+
+		   // Everything this tile takes from the arena is dropped here.
+		   FrameArena& arena = FrameArena::local();
+		   arena.reset();
+		   FilmTile tile(*film_ptr, packet_x0 * packet_width_x, packet_x1 * packet_width_x,
+				 packet_y0 * packet_width_y, packet_y1 * packet_width_y);
+
+		   for (uint32_t packet_y = packet_y0; packet_y < packet_y1; packet_y++) {
+			   for (uint32_t packet_x = packet_x0; packet_x < packet_x1; packet_x++) {
+				   uint32_t packet_num = packet_y * sampler_ptr->p_count_x + packet_x;
+				   // converged packets sit out adaptive passes
+				   if (threshold > 0 && packet_errors[packet_num] <= threshold)
+					   continue;
+
+				   // the packet's scratch goes before the next one; the tile stays
+				   FrameArena::Scope scope(arena);
+				   trace_integrator_packet(integrator_ptr, width, height, packet_num, tile);
 			   }
 		   }
-	    
-		}	
-	}
 
-    void Raytracer::trace_packet(size_t width, size_t height) {
-	uint32_t wanted_packet_num = (width + packet_width_x - 1) / packet_width_x * 
-	    ((height + packet_width_y - 1) / packet_width_y);
-	Random462 rng;
+		   // work tiles do not overlap; only their borders wait for the
+		   // ordered merge below
+		   film_ptr->mergeTile(tile, &aprons[i]);
+		}	
 
-#pragma omp parallel for num_threads(num_threads)
-	for (int i = 0; i < wanted_packet_num; i++) {
-           Color3* packet_color = new Color3[packet_width_x * packet_width_y * num_samples];
+		for (uint32_t i = 0; i < wanted_work_num; i++)
+			film_ptr->mergeApron(aprons[i]);
+	}
 
-            // All numbers should have been rounded
-	   size_t p_x;
-	   size_t p_y;
+    void Raytracer::trace_color_packet(size_t width, size_t height, uint32_t packet_num, FilmTile &tile) {
+	Color3* packet_color = FrameArena::local().alloc<Color3>(packet_width_x * packet_width_y * num_samples);
 
-	   // Clamped along the boundary.
-	   Packet packet(packet_width_ray * packet_width_ray);
-	   Sample *samples;
+	// All numbers should have been rounded
+	size_t p_x;
+	size_t p_y;
 
-	   build_packet_sampler(width, height, packet, samples, p_x, p_y, rng);
+	// Clamped along the boundary.
+	Packet packet(packet_width_ray * packet_width_ray);
+	Sample *samples;
+	Random462 *rngs;
 
-	   std::vector< std::vector<real_t> > refractiveStack;
-	   for(int i=0;i<packet.size;i++)
-	       {
-		   std::vector<real_t> rstack;
-		   rstack.push_back(scene->refractive_index);
-		   refractiveStack.push_back(rstack);
-	       }
+	build_packet_sampler(width, height, packet_num, packet, samples, rngs, p_x, p_y);
 
-	   scene->getColors(packet, refractiveStack, packet_color);
+	std::vector< std::vector<real_t> > refractiveStack;
+	for(int i=0;i<packet.size;i++)
+	    {
+		std::vector<real_t> rstack;
+		rstack.push_back(scene->refractive_index);
+		refractiveStack.push_back(rstack);
+	    }
 
-	   for (size_t y = 0; y < packet_width_y; y++) {
-	       for (size_t x = 0; x < packet_width_x; x++) {
+	scene->getColors(packet, rngs, refractiveStack, packet_color);
 
-		   if ((p_x + x) >= width || (p_y + y) >= height)
-		       continue;
+	addPacketSamples(tile, samples, packet_color, width, height, p_x, p_y);
+    }
 
-		   for (size_t count = 0; count < num_samples; count++) {
-		       uint32_t offset = y * packet_width_x * num_samples +
-			   x * num_samples + count;
+    void Raytracer::trace_packet(size_t width, size_t height) {
+	// work tiles are whole packets, as in trace_packet_integrator
+	uint32_t packets_x = std::max(1u, pixel_width / packet_width_x);
+	uint32_t packets_y = std::max(1u, pixel_width / packet_width_y);
+	uint32_t work_num_x = (sampler_ptr->p_count_x + packets_x - 1) / packets_x;
+	uint32_t work_num_y = (sampler_ptr->p_count_y + packets_y - 1) / packets_y;
+	uint32_t wanted_work_num = work_num_x * work_num_y;
+	std::vector<FilmApron> aprons(wanted_work_num);
 
-		       film_ptr->addSample(samples[offset], packet_color[offset]);
+#pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+	for (int i = 0; i < wanted_work_num; i++) {
+	   uint32_t work_y = i / work_num_x;
+	   uint32_t work_x = i - work_y * work_num_x;
+	   uint32_t packet_x0 = work_x * packets_x;
+	   uint32_t packet_x1 = std::min(packet_x0 + packets_x, sampler_ptr->p_count_x);
+	   uint32_t packet_y0 = work_y * packets_y;
+	   uint32_t packet_y1 = std::min(packet_y0 + packets_y, sampler_ptr->p_count_y);
+
+	   FrameArena& arena = FrameArena::local();
+	   arena.reset();
+	   FilmTile tile(*film_ptr, packet_x0 * packet_width_x, packet_x1 * packet_width_x,
+			 packet_y0 * packet_width_y, packet_y1 * packet_width_y);
+
+	   for (uint32_t packet_y = packet_y0; packet_y < packet_y1; packet_y++) {
+		   for (uint32_t packet_x = packet_x0; packet_x < packet_x1; packet_x++) {
+			   FrameArena::Scope scope(arena);
+			   trace_color_packet(width, height, packet_y * sampler_ptr->p_count_x + packet_x, tile);
 		   }
-	       }
 	   }
 
-	    // Get color here. (func in scene)
-	    delete[] packet_color;
-	    
+	   film_ptr->mergeTile(tile, &aprons[i]);
 	}	
+
+	for (uint32_t i = 0; i < wanted_work_num; i++)
+	    film_ptr->mergeApron(aprons[i]);
     
     }
 
@@ -541,8 +662,10 @@ namespace _462 {
             size_t cur_work_x = work_count - cur_work_y * work_num_x;
 
 			
+           FrameArena::local().reset();
            // Get color here. (func in scene)
-           Color3* packet_color = new Color3[packet_width_x * packet_width_y * num_samples];
+           Color3* packet_color = FrameArena::local().alloc<Color3>(packet_width_x * packet_width_y * num_samples);
+           Random462* rngs = FrameArena::local().alloc<Random462>(packet_width_x * packet_width_y * num_samples);
 
             // All numbers should have been rounded
             for (size_t cur_packet_y = 0; cur_packet_y < pixel_width / packet_width_y; cur_packet_y++) {
@@ -555,7 +678,7 @@ namespace _462 {
 
                     // Clamped along the boundary.
                     Packet packet(packet_width_ray * packet_width_ray);
-                    build_packet(p_x, p_y, width, height, packet);
+                    build_packet(p_x, p_y, width, height, packet, rngs, 0);
 
                     tc[omp_get_thread_num()] += SDL_GetTicks() -tt;
 
@@ -569,7 +692,7 @@ namespace _462 {
                     }
 
                     td[omp_get_thread_num()] += SDL_GetTicks() -tt;
-                    scene->getColors(packet, refractiveStack, packet_color);
+                    scene->getColors(packet, rngs, refractiveStack, packet_color);
 
                     te[omp_get_thread_num()] += SDL_GetTicks() -tt;
 
@@ -594,8 +717,6 @@ namespace _462 {
                 }
             }
 
-                    // Get color here. (func in scene)
-			delete[] packet_color;
         }
 
         for(int i=0;i<20;i++)
@@ -706,7 +827,7 @@ namespace _462 {
 			//dir_int.initialize_sampler(scene, sampler_ptr);
 			PathIntegrator path_int(scene, opt_ptr->sample_depth, opt_ptr->max_depth, opt_ptr->num_per_path);
 			path_int.initialize_sampler(scene, sampler_ptr);
-			trace_packet_integrator(&path_int, width, height);
+			trace_adaptive(&path_int, width, height);
 			//trace_packet(width, height);
 			is_done = true;
 
@@ -15,6 +15,8 @@
 
 #include "sample/stratified.hpp"
 #include "sample/halton.hpp"
+#include "sample/sobol.hpp"
+#include "sample/random.hpp"
 #include "filter/film.hpp"
 #include "filter/box.hpp"
 #include "filter/gaussian.hpp"
@@ -55,11 +57,13 @@ private:
 		       size_t y,
 		       size_t width,
 		       size_t height);
-    Vector3 get_viewing_ray(size_t x, size_t y);
     void build_frustum(Frustum& frustum, real_t xmin, real_t xmax,
 		       real_t ymin, real_t ymax);
 
-    void build_packet(size_t x, size_t y, size_t width, size_t height, Packet& packet);
+    // rngs gets the stream of each ray's sample. The packet_index-th
+    // packet of a pixel takes its samples after those of earlier packets.
+    void build_packet(size_t x, size_t y, size_t width, size_t height, Packet& packet,
+		      Random462* rngs, size_t packet_index);
 
     // when multiple packets inside one pixel
     void trace_small_packet(unsigned char* buffer,
@@ -71,10 +75,31 @@ private:
 			    size_t width,
 			    size_t height);
 
-    void build_packet_sampler(size_t width, size_t height, Packet& packet, Sample *&samples,
-		size_t &p_x, size_t &p_y, Random462 &rng);
+    // As build_packet, for packet packet_num of the sampler; samples and
+    // rngs come from the calling thread's arena.
+    void build_packet_sampler(size_t width, size_t height, uint32_t packet_num,
+		Packet& packet, Sample *&samples, Random462 *&rngs, size_t &p_x, size_t &p_y);
+    // Adds a packet's samples and colors, laid out as build_packet_sampler
+    // leaves them, to tile.
+    void addPacketSamples(FilmTile &tile, const Sample *samples, const Color3 *packet_color,
+			  size_t width, size_t height, size_t p_x, size_t p_y);
+    // Whitted packets over work tiles of about pixel_width on a side.
     void trace_packet(size_t width, size_t height);
-	void trace_packet_integrator(SurfaceIntegrator *integrator_ptr, size_t width, size_t height);
+    // Traces packet packet_num with the Whitted shader into tile.
+    void trace_color_packet(size_t width, size_t height, uint32_t packet_num, FilmTile &tile);
+	// Traces every packet of the sampler's current pass, skipping those
+	// whose pixels were all below threshold error when the pass started
+	// (0 traces every packet). Each thread takes work tiles of about
+	// pixel_width x pixel_width pixels and splats all their packets into
+	// one FilmTile. Work tiles not started by SDL tick deadline (0 for
+	// none) are skipped.
+	void trace_packet_integrator(SurfaceIntegrator *integrator_ptr, size_t width, size_t height,
+				     float threshold = 0, uint32_t deadline = 0);
+	// Traces packet packet_num into tile.
+	void trace_integrator_packet(SurfaceIntegrator *integrator_ptr, size_t width, size_t height,
+				     uint32_t packet_num, FilmTile &tile);
+	// Multi-pass adaptive driver around trace_packet_integrator.
+	void trace_adaptive(SurfaceIntegrator *integrator_ptr, size_t width, size_t height);
 
     // the scene to trace
     Scene* scene;
@@ -96,7 +121,6 @@ private:
     uint32_t packet_width_x, packet_width_y;
 
     uint32_t num_threads;
-    Random462 rng;
     Sampler *sampler_ptr;
 
 	Options *opt_ptr;
@@ -0,0 +1,118 @@
+#include <cmath>
+#include "bluenoise.hpp"
+#include "sampler.hpp"
+
+namespace _462 {
+
+static const uint32_t N = BlueNoiseMask::SIZE * BlueNoiseMask::SIZE;
+
+// Gaussian energy of a set of pixels on the torus, updated as pixels
+// enter and leave the set.
+class EnergyField {
+public:
+    EnergyField() : energy(N, 0.f), kernel(N) {
+	const float sigma = 1.5f;
+	const int size = BlueNoiseMask::SIZE;
+	for (int y = 0; y < size; y++) {
+	    for (int x = 0; x < size; x++) {
+		int dx = std::min(x, size - x), dy = std::min(y, size - y);
+		kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+	    }
+	}
+    }
+
+    void update(uint32_t p, float sign) {
+	const uint32_t size = BlueNoiseMask::SIZE;
+	uint32_t px = p % size, py = p / size;
+	for (uint32_t y = 0; y < size; y++) {
+	    const float *row = &kernel[((y - py) & (size - 1)) * size];
+	    float *out = &energy[y * size];
+	    for (uint32_t x = 0; x < size; x++)
+		out[x] += sign * row[(x - px) & (size - 1)];
+	}
+    }
+
+    // The set pixel with the most energy, or the free one with the least.
+    uint32_t tightest_cluster(const std::vector<bool> &set) const {
+	return find(set, true);
+    }
+    uint32_t largest_void(const std::vector<bool> &set) const {
+	return find(set, false);
+    }
+
+private:
+    uint32_t find(const std::vector<bool> &set, bool in_set) const {
+	uint32_t best = N;
+	for (uint32_t p = 0; p < N; p++) {
+	    if (set[p] != in_set)
+		continue;
+	    if (best == N || (in_set ? energy[p] > energy[best] : energy[p] < energy[best]))
+		best = p;
+	}
+	return best;
+    }
+
+    std::vector<float> energy;
+    std::vector<float> kernel;
+};
+
+BlueNoiseMask::BlueNoiseMask() : mask(N) {
+    std::vector<uint32_t> rank(N);
+
+    // initial binary pattern: a tenth of the pixels, relaxed until the
+    // tightest cluster is also the largest void
+    std::vector<bool> prototype(N, false);
+    EnergyField prototype_energy;
+    uint32_t ones = 0;
+    for (uint32_t p = 0; ones < N / 10; p++) {
+	uint32_t q = hash_bits(p) % N;
+	if (prototype[q])
+	    continue;
+	prototype[q] = true;
+	prototype_energy.update(q, 1.f);
+	ones++;
+    }
+    while (true) {
+	uint32_t cluster = prototype_energy.tightest_cluster(prototype);
+	prototype[cluster] = false;
+	prototype_energy.update(cluster, -1.f);
+	uint32_t void_ = prototype_energy.largest_void(prototype);
+	prototype[void_] = true;
+	prototype_energy.update(void_, 1.f);
+	if (void_ == cluster)
+	    break;
+    }
+
+    // phase 1: rank the prototype's pixels by removing tightest clusters
+    std::vector<bool> set = prototype;
+    EnergyField energy = prototype_energy;
+    for (uint32_t r = ones; r > 0; r--) {
+	uint32_t cluster = energy.tightest_cluster(set);
+	set[cluster] = false;
+	energy.update(cluster, -1.f);
+	rank[cluster] = r - 1;
+    }
+
+    // phases 2 and 3: fill the largest voids; past half the pixels this
+    // is the same as the tightest cluster of the free ones
+    set = prototype;
+    energy = prototype_energy;
+    for (uint32_t r = ones; r < N; r++) {
+	uint32_t void_ = energy.largest_void(set);
+	set[void_] = true;
+	energy.update(void_, 1.f);
+	rank[void_] = r;
+    }
+
+    for (uint32_t p = 0; p < N; p++)
+	mask[p] = (rank[p] + 0.5f) / N;
+}
+
+float BlueNoiseMask::value(uint32_t x, uint32_t y, uint32_t dim) const {
+    uint32_t offset = hash_bits(dim);
+    x = (x + offset) & (SIZE - 1);
+    y = (y + (offset >> 16)) & (SIZE - 1);
+    return mask[y * SIZE + x];
+}
+
+}
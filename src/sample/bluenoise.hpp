@@ -0,0 +1,30 @@
+#ifndef _462_BLUENOISE_HPP_
+#define _462_BLUENOISE_HPP_
+
+#include <vector>
+#include "math/math.hpp"
+
+namespace _462 {
+
+/*
+ * Tileable blue-noise threshold mask made with void-and-cluster
+ * (Ulichney 1993): every value in [0, 1) appears once, and neighbouring
+ * cells hold values far apart. Built once when constructed.
+ */
+class BlueNoiseMask {
+public:
+    static const uint32_t SIZE = 64;
+
+    BlueNoiseMask();
+
+    // Mask value at pixel (x, y), tiled over the screen. Each dim reads
+    // the mask at its own toroidal offset, so dimensions stay uncorrelated.
+    float value(uint32_t x, uint32_t y, uint32_t dim) const;
+
+private:
+    std::vector<float> mask;
+};
+
+}
+
+#endif
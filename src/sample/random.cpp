@@ -3,28 +3,11 @@
 
 namespace _462 {
 
-Sample *RandomSampler::getPacketSamples(uint32_t &x, uint32_t &y, Random462 &rng) {
-    uint32_t des_packet;
-#ifdef _WINDOWS
-#pragma omp critical
-	{
-		des_packet = current_packet++;
-	}
-#else
-	des_packet = __sync_fetch_and_add(&current_packet, 1);
-#endif
-
-    if (des_packet >= wanted_packet_num)
-	return NULL;
-
-    uint32_t p_x, p_y;
-    p_y = des_packet / (width / p_width_x);
-    p_x = des_packet - (p_y * width / p_width_x);
-
+Sample *RandomSampler::getPacketSamples(uint32_t packet, uint32_t &x, uint32_t &y) {
     uint32_t x_start, x_end, y_start, y_end;
-    x_start = p_x * p_width_x;
+    if (!getPacketOrigin(packet, x_start, y_start))
+	return NULL;
     x_end = x_start + p_width_x;
-    y_start = p_y * p_width_y;
     y_end = y_start + p_width_y;
 
     Sample *result = sampleset.addEmptySamples(p_width_x * p_width_y * pixel_num_sample);
@@ -46,8 +29,8 @@ Sample *RandomSampler::getPacketSamples(uint32_t &x, uint32_t &y, Random462 &rng
     for (int j = y_start; j < y_end; j++) {
 		for (int i = x_start; i < x_end; i++) {
 			for (int k = 0; k < pixel_num_sample; k++) {
-				result[count].x = float(i)+ rng.random();
-				result[count++].y = float(j)+ rng.random();
+				result[count].x = float(i)+ sample_uniform(j * width + i, first_sample + k, 0);
+				result[count++].y = float(j)+ sample_uniform(j * width + i, first_sample + k, 1);
 			}
 		}
     }
@@ -2,17 +2,19 @@
 #include "sampler.hpp"
 
 namespace _462 {
-void latin_hypercube(float *samples, uint32_t dim, uint32_t num, Random462 &rng) {
+void latin_hypercube(float *samples, uint32_t dim, uint32_t num,
+					 uint32_t pixel, uint32_t index, uint32_t first_dim) {
 	float delta = 1.f / num;
+	uint32_t d = first_dim;
 	for (uint32_t i = 0; i < num; i++) {
 		for (uint32_t j = 0; j < dim; j++) {
-			samples[i * dim + j] = (i + rng.random()) * delta;
+			samples[i * dim + j] = (i + sample_uniform(pixel, index, d++)) * delta;
 		}
 	}
 
 	for (uint32_t i = 0; i < dim; i++) {
 		for (uint32_t j = 0; j < num; j++) {
-			uint32_t other = j + (rng.random_int() % (num - j));
+			uint32_t other = j + (sample_bits(pixel, index, d++) % (num - j));
 			float temp = samples[j * dim + i];
 			samples[j * dim + i] = samples[other * dim + i];
 			samples[other * dim + i] = temp;
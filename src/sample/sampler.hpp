@@ -10,6 +10,7 @@
 #include "math/vector.hpp"
 #include "scene/bvh.hpp"
 #include "math/random462.hpp"
+#include "math/arena.hpp"
 
 namespace _462 {
 
@@ -111,7 +112,32 @@ inline Vector3 cos_sampled_hemisphere(float r1, float r2) {
 	return result;
 }
 
-void latin_hypercube(float *samples, uint32_t dim, uint32_t num, Random462 &rng);
+// Scrambles v so that nearby inputs give unrelated outputs.
+inline uint32_t hash_bits(uint32_t v) {
+	v ^= v >> 16;
+	v *= 0x7feb352dU;
+	v ^= v >> 15;
+	v *= 0x846ca68bU;
+	v ^= v >> 16;
+	return v;
+}
+
+// Stateless random bits for dimension dim of sample index of pixel. The
+// same triple always gives the same bits, whichever thread asks.
+inline uint32_t sample_bits(uint32_t pixel, uint32_t index, uint32_t dim) {
+	return hash_bits(pixel ^ hash_bits(index ^ hash_bits(dim + 0x9e3779b9U)));
+}
+
+// As sample_bits, mapped to [0, 1).
+inline float sample_uniform(uint32_t pixel, uint32_t index, uint32_t dim) {
+	return (sample_bits(pixel, index, dim) >> 8) * (1.f / (1 << 24));
+}
+
+// num stratified points in [0, 1)^dim, randomized from dimensions
+// first_dim, first_dim + 1, ... (2 * dim * num of them) of sample index
+// of pixel.
+void latin_hypercube(float *samples, uint32_t dim, uint32_t num,
+					 uint32_t pixel, uint32_t index, uint32_t first_dim);
 
 struct Distribution1D {
 	Distribution1D(float *func, uint32_t size);
@@ -150,18 +176,17 @@ struct Sample {
     float x, y;
 };
 
+/*
+ * Layout of one sample: the film position, then every 1D and 2D dimension
+ * the integrator asked for. Samplers write a packet's samples into the
+ * calling thread's FrameArena, where they live until the arena is
+ * rewound past them.
+ */
 class SampleSet {
 public:
     
-    SampleSet(uint32_t capacity)
-		: samples(NULL), sample_capacity(capacity), current(0), current_one_offset(0),
-		current_two_offset(0), max_set_size(800 * 600 * 4) { }
-    ~SampleSet() {
-		current = 0;
-		current_one_offset = 0;
-		current_two_offset = 0;
-		_aligned_free(samples);
-    }
+    SampleSet()
+		: sample_size(0), current_one_offset(0), current_two_offset(0) { }
 
 	// not thread-safe
     uint32_t add1D(uint32_t oneD) {
@@ -185,6 +210,7 @@ public:
 		twoD_num.push_back(1);
 	}
 
+	// Fixes the sample size once every dimension has been added.
     void allocateSamples() {
 		sample_size = 0;
 
@@ -195,119 +221,20 @@ public:
 		for (int i = 0; i < twoD_num.size(); i++) {
 			sample_size += twoD_num[i] * 2;
 		}
-
-		alloc_size = (std::min(max_set_size, sample_capacity * sample_size) + sample_size - 1) / sample_size;
-		do {
-			samples = (float*)memalign(16, sizeof(float) * sample_size * alloc_size);
-			if (samples == NULL)
-				alloc_size /= 2;
-		} while(samples == NULL);
-    }
-
-    Sample *addSample(float *oneD, float *twoD) {
-		uint32_t des = 0;
-
-	#ifdef _WINDOWS
-	#pragma omp critical
-		{
-			des = current++;
-			
-		}
-	#else
-		des = __sync_fetch_and_add(&current, 1);
-	#endif
-		if (des >= alloc_size)
-				des = des % alloc_size;
-		assert(des < sample_capacity);
-
-		memcpy(samples + sample_size * des, oneD, sizeof(float) * oneD_num.size());
-		memcpy(samples + sample_size * des + oneD_num.size(), 
-			   twoD, sizeof(float) * twoD_num.size() * 2);
-	
-		return (Sample*)(samples + sample_size * des);
-    }
-
-    // oneD : one1...
-    //        one2...
-    Sample *addSamples(float *oneD, float *twoD, uint32_t count) {
-	uint32_t des = 0;
-
-	#ifdef _WINDOWS
-	#pragma omp critical
-		{
-			do {
-				des = current;
-				if (des >= alloc_size)
-					des = des % alloc_size;
-				current += count;
-			} while (des < alloc_size && des + count - 1 >= alloc_size);
-		}
-	#else
-		do {
-				des = __sync_fetch_and_add(&current, count);
-				if (des >= alloc_size)
-					des = des % alloc_size;
-			} while (des < alloc_size && des + count - 1 >= alloc_size);
-		
-	#endif
-
-		assert(des < sample_capacity);
-
-		uint32_t oneD_size = oneD_num.size();
-		uint32_t twoD_size = twoD_num.size();
-
-		for (int i = 0; i < count; i++) {
-			for (int j = 0; j < oneD_size; j++)
-			samples[sample_size * (des + i) + j] = oneD[j * count + i];
-			for (int j = 0; j < twoD_size; j++) {
-			samples[oneD_size + sample_size * (des + i) + 2 * j] = twoD[j * count * 2 + 2 * i];
-			samples[oneD_size + sample_size * (des + i) + 2 * j + 1] = 
-				twoD[j * count * 2 + 2 * i + 1];
-			}
-		}
-	
-		return (Sample*)(samples + sample_size * des);
     }
 
+	// Scratch for count samples from the calling thread's arena.
     Sample *addEmptySamples(uint32_t count) {
-		uint32_t des = -1;
-
-	#ifdef _WINDOWS
-	#pragma omp critical
-		{
-			do {
-				des = current;
-				if (des >= alloc_size)
-					des = des % alloc_size;
-				current += count;
-			} while (des < alloc_size && des + count - 1 >= alloc_size);
-		}
-	#else
-		do {
-				des = __sync_fetch_and_add(&current, count);
-				if (des >= alloc_size)
-					des = des % alloc_size;
-			} while (des < alloc_size && des + count - 1 >= alloc_size);
-	#endif
-
-		assert(des >= 0);
-		assert(des < sample_capacity);
-	
-		return (Sample*)(samples + sample_size * des);
+		return (Sample*)FrameArena::local().alloc<float>(count * sample_size);
     }
 
     std::vector<uint32_t> oneD_num;
     std::vector<uint32_t> twoD_num;
     uint32_t sample_size;
-    float *samples;
-    uint32_t sample_capacity;
 
 private:
-    uint32_t current;
 	uint32_t current_one_offset;
 	uint32_t current_two_offset;
-	const uint32_t max_set_size;
-	uint32_t alloc_size;
 };
 
 class Sampler {
@@ -316,7 +243,7 @@ public:
     Sampler (uint32_t width, uint32_t height, uint32_t p_width_x, uint32_t p_width_y,
 	     uint32_t pixel_num_sample) :
 	width(width), height(height), p_width_x(p_width_x), p_width_y(p_width_y),
-	pixel_num_sample(pixel_num_sample), sampleset(width * height * pixel_num_sample) {
+	pixel_num_sample(pixel_num_sample), first_sample(0) {
 		p_count_x = width / p_width_x;
 		p_count_y = height / p_width_y;
 		sampleset.add2Dxy();
@@ -324,7 +251,23 @@ public:
 
     virtual ~Sampler() { }
 
-    virtual Sample *getPacketSamples(uint32_t &x, uint32_t &y, Random462 &rng) = 0;
+    // Samples of packet number packet in this pass, in the calling
+    // thread's arena; the packet's first pixel goes to (x, y). NULL past
+    // the last packet. Any thread can ask for any packet.
+    virtual Sample *getPacketSamples(uint32_t packet, uint32_t &x, uint32_t &y) = 0;
+
+	uint32_t getPacketCount() const {
+		return p_count_x * p_count_y;
+	}
+
+	// First pixel of packet; false past the last packet.
+	bool getPacketOrigin(uint32_t packet, uint32_t &x, uint32_t &y) const {
+		if (packet >= getPacketCount())
+			return false;
+		x = packet % p_count_x * p_width_x;
+		y = packet / p_count_x * p_width_y;
+		return true;
+	}
 
 	void allocate() {
 		sampleset.allocateSamples();
@@ -342,6 +285,18 @@ public:
 	return sampleset.sample_size;
     }
 
+	// Makes packets carry the pixel samples pass * pixel_num_sample ...
+	// (pass + 1) * pixel_num_sample - 1. Not thread-safe; call between
+	// passes.
+	void startPass(uint32_t pass) {
+		first_sample = pass * pixel_num_sample;
+	}
+
+	// Index of the first sample of a pixel handed out in this pass.
+	uint32_t get_first_sample() const {
+		return first_sample;
+	}
+
     uint32_t width, height;
     uint32_t p_width_x, p_width_y;
     uint32_t p_count_x, p_count_y;
@@ -349,6 +304,7 @@ public:
 
 protected:
     SampleSet sampleset;
+    uint32_t first_sample;
 
 };
 
@@ -0,0 +1,144 @@
+#include "sobol.hpp"
+
+namespace _462 {
+
+// Generator matrix columns of the second Sobol dimension; the first one
+// is the bit reversal of the index.
+static const uint32_t sobol_matrix_1[32] = {
+    0x80000000, 0xc0000000, 0xa0000000, 0xf0000000,
+    0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+    0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000,
+    0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+    0x80008000, 0xc000c000, 0xa000a000, 0xf000f000,
+    0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+    0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0,
+    0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff
+};
+
+static inline uint32_t reverse_bits(uint32_t v) {
+    v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+    v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+    v = ((v >> 8) & 0x00ff00ff) | ((v & 0x00ff00ff) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+// Branch free so the loops over samples below vectorize.
+static inline uint32_t sobol_1(uint32_t index) {
+    uint32_t v = 0;
+    for (int b = 0; b < 32; b++)
+	v ^= sobol_matrix_1[b] & (0u - ((index >> b) & 1));
+    return v;
+}
+
+// Laine-Karras hash: every output bit only depends on the input bits
+// below it, which makes it a nested uniform scramble of the reversed bits.
+static inline uint32_t laine_karras(uint32_t v, uint32_t seed) {
+    v += seed;
+    v ^= v * 0x6c50b47c;
+    v ^= v * 0xb82f1e52;
+    v ^= v * 0xc7afe638;
+    v ^= v * 0x8d22f6e6;
+    return v;
+}
+
+static inline uint32_t owen_scramble(uint32_t v, uint32_t seed) {
+    return reverse_bits(laine_karras(reverse_bits(v), seed));
+}
+
+static inline float to_unit(uint32_t v) {
+    return (v >> 8) * (1.f / (1 << 24));
+}
+
+void sobol_padded(float *out, uint32_t stride, uint32_t run, uint32_t dim, uint32_t n,
+		  uint32_t pixel, uint32_t group, uint32_t first) {
+    uint32_t seed = sample_bits(pixel, 0, group);
+    uint32_t seed_x = hash_bits(seed ^ 0x1), seed_y = hash_bits(seed ^ 0x2);
+
+    float *run_out = out;
+    uint32_t in_run = 0;
+    for (uint32_t i = 0; i < n; i++) {
+	// shuffled index; the first 2^m of them stay an aligned block of
+	// Sobol indices, so the points keep their stratification
+	uint32_t index = owen_scramble(first + i, seed);
+	float *p = run_out + in_run * dim;
+	p[0] = to_unit(owen_scramble(reverse_bits(index), seed_x));
+	if (dim == 2)
+	    p[1] = to_unit(owen_scramble(sobol_1(index), seed_y));
+	if (++in_run == run) {
+	    in_run = 0;
+	    run_out += stride;
+	}
+    }
+}
+
+void SobolSampler::generate(float *out, uint32_t stride, uint32_t run, uint32_t dim,
+			    uint32_t n, uint32_t x, uint32_t y, uint32_t group,
+			    uint32_t first) const {
+    if (mask == NULL) {
+	sobol_padded(out, stride, run, dim, n, y * width + x, group, first);
+	return ;
+    }
+
+    sobol_padded(out, stride, run, dim, n, 0, group, first);
+    for (uint32_t c = 0; c < dim; c++) {
+	float shift = mask->value(x, y, group * 2 + c);
+	for (uint32_t r = 0; r < n / run; r++) {
+	    float *p = out + r * stride + c;
+	    for (uint32_t i = 0; i < run; i++) {
+		float v = p[i * dim] + shift;
+		p[i * dim] = (v >= 1.f) ? v - 1.f : v;
+	    }
+	}
+    }
+}
+
+Sample *SobolSampler::getPacketSamples(uint32_t packet, uint32_t &x, uint32_t &y) {
+    uint32_t x_start, x_end, y_start, y_end;
+    if (!getPacketOrigin(packet, x_start, y_start))
+	return NULL;
+    x_end = x_start + p_width_x;
+    y_end = y_start + p_width_y;
+
+    Sample *result = sampleset.addEmptySamples(p_width_x * p_width_y * pixel_num_sample);
+    uint32_t sample_size = sampleset.sample_size;
+    uint32_t oneD_size = sampleset.oneD_num.size();
+
+    float *pixel_result = (float*)result;
+    for (uint32_t j = y_start; j < y_end; j++) {
+      for (uint32_t i = x_start; i < x_end; i++) {
+	// film position, all samples of the pixel at once
+	generate(pixel_result, sample_size, 1, 2, pixel_num_sample, i, j, 0, first_sample);
+	for (uint32_t k = 0; k < pixel_num_sample; k++) {
+	  pixel_result[k * sample_size] += i;
+	  pixel_result[k * sample_size + 1] += j;
+	}
+
+	// integrator dimensions, one group across all samples of the pixel:
+	// the n values of a group in sample k are the Sobol indices
+	// k * n ... k * n + n - 1, a run of n in every sample
+	float *group = pixel_result + 2;
+	for (uint32_t g = 0; g < oneD_size; g++) {
+	  uint32_t n = sampleset.oneD_num[g];
+	  generate(group, sample_size, n, 1, pixel_num_sample * n, i, j,
+		   1 + g, first_sample * n);
+	  group += n;
+	}
+	for (uint32_t g = 1; g < sampleset.twoD_num.size(); g++) {
+	  uint32_t n = sampleset.twoD_num[g];
+	  generate(group, sample_size, n, 2, pixel_num_sample * n, i, j,
+		   1 + oneD_size + g, first_sample * n);
+	  group += 2 * n;
+	}
+
+	pixel_result += pixel_num_sample * sample_size;
+      }
+    }
+
+    x = x_start;
+    y = y_start;
+
+    return result;
+}
+
+}
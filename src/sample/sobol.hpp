@@ -0,0 +1,53 @@
+#ifndef _462_SOBOLSAMPLER_HPP_
+#define _462_SOBOLSAMPLER_HPP_
+
+#include "sampler.hpp"
+#include "bluenoise.hpp"
+
+namespace _462 {
+
+/*
+ * Padded Sobol sampler: every 1D or 2D dimension of a sample takes the
+ * first two Sobol dimensions, Owen scrambled and with the sample index
+ * shuffled per pixel and dimension (Burley 2020). Values are pure
+ * functions of (pixel, sample index, dimension), so no direction number
+ * tables beyond the second dimension are needed and any thread can
+ * evaluate any sample.
+ *
+ * In blue-noise mode every pixel gets the same scrambled sequence,
+ * Cranley-Patterson rotated by a tiled blue-noise mask. The error of
+ * neighbouring pixels is then anti-correlated and shows up as high
+ * frequency noise, which reads better at 1 to 4 samples per pixel.
+ */
+class SobolSampler : public Sampler {
+public:
+    SobolSampler(uint32_t width, uint32_t height, uint32_t p_width_x, uint32_t p_width_y,
+		 uint32_t pixel_num_sample, bool blue_noise = false) :
+	Sampler(width, height, p_width_x, p_width_y, pixel_num_sample),
+	mask(blue_noise ? new BlueNoiseMask() : NULL) {
+    }
+
+    ~SobolSampler() {
+	delete mask;
+    }
+
+    Sample *getPacketSamples(uint32_t packet, uint32_t &x, uint32_t &y);
+
+private:
+    // Points of one padded dimension of pixel (x, y), as sobol_padded.
+    void generate(float *out, uint32_t stride, uint32_t run, uint32_t dim, uint32_t n,
+		  uint32_t x, uint32_t y, uint32_t group, uint32_t first) const;
+    // NULL unless in blue-noise mode
+    BlueNoiseMask *mask;
+};
+
+// Writes n points of one padded dimension for sample indices first,
+// first + 1, ... of pixel. Points come in runs of run, dim values apart,
+// and the runs start stride floats apart at out. dim is 1 or 2; group
+// tells the dimensions of a sample apart.
+void sobol_padded(float *out, uint32_t stride, uint32_t run, uint32_t dim, uint32_t n,
+		  uint32_t pixel, uint32_t group, uint32_t first);
+
+}
+
+#endif
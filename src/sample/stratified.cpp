@@ -15,28 +15,11 @@ void StratifiedSampler::roundSize(uint32_t n) {
 	pixel_num_y = y;
 }
 
-Sample *StratifiedSampler::getPacketSamples(uint32_t &x, uint32_t &y, Random462 &rng) {
-    uint32_t des_packet;
-#ifdef _WINDOWS
-#pragma omp critical
-	{
-		des_packet = current_packet++;
-	}
-#else
-	des_packet = __sync_fetch_and_add(&current_packet, 1);
-#endif
-
-    if (des_packet >= wanted_packet_num)
-	return NULL;
-
-    uint32_t p_x, p_y;
-    p_y = des_packet / (width / p_width_x);
-    p_x = des_packet - (p_y * width / p_width_x);
-
+Sample *StratifiedSampler::getPacketSamples(uint32_t packet, uint32_t &x, uint32_t &y) {
     uint32_t x_start, x_end, y_start, y_end;
-    x_start = p_x * p_width_x;
+    if (!getPacketOrigin(packet, x_start, y_start))
+	return NULL;
     x_end = x_start + p_width_x;
-    y_start = p_y * p_width_y;
     y_end = y_start + p_width_y;
 
     Sample *result = sampleset.addEmptySamples(p_width_x * p_width_y * pixel_num_sample);
@@ -62,8 +45,9 @@ Sample *StratifiedSampler::getPacketSamples(uint32_t &x, uint32_t &y, Random462
       for (uint32_t i = x_start; i < x_end; i++) {
 	for (uint32_t p_y = 0; p_y < pixel_num_y; p_y++) {
 	  for (uint32_t p_x = 0; p_x < pixel_num_x; p_x++) {
-	    result[count].x = float(i)+ (p_x + rng.random()) * dx;
-	    result[count++].y = float(j)+ (p_y + rng.random()) * dy;
+	    uint32_t k = p_y * pixel_num_x + p_x;
+	    result[count].x = float(i)+ (p_x + sample_uniform(j * width + i, first_sample + k, 0)) * dx;
+	    result[count++].y = float(j)+ (p_y + sample_uniform(j * width + i, first_sample + k, 1)) * dy;
 	  }
 	}
       }
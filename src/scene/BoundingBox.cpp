@@ -97,9 +97,9 @@ bool BoundingBox::hit(BoundingBox box)const
 }
 
 bool BoundingBox::hit(const Frustum& frustum) const {
-    // n/p vertex
+    // Only the p vertex can reject the box. A box straddling one plane may
+    // still lie outside another, so every plane is checked.
     Vector3 p;
-    Vector3 n;
     Vector3 center = 0.5 * (lowCoord + highCoord);
     Vector3 extent = 0.5 * (highCoord - lowCoord);
     
@@ -118,16 +118,6 @@ bool BoundingBox::hit(const Frustum& frustum) const {
 	    < 0) {
 	    return false;
 	}
-
-	n.x = center.x - x_sign * extent.x;
-	n.y = center.y - y_sign * extent.y;
-	n.z = center.z - z_sign * extent.z;
-
-	// n vertex is outside, given p vertex is inside
-	if (dot(n - frustum.planes[i].point, frustum.planes[i].norm)
-	    < 0)
-	    return true;
-
     }
     
     return true;
@@ -221,6 +211,55 @@ void BoundingBox::hit(const Packet& packet, int start, int end, float *t0, float
     */
 }
 
+// Product of the intervals [a0, a1] and [b0, b1]. Returns false if the
+// result is undefined (0 * inf), in which case the axis can't be used.
+static inline bool interval_mul(real_t a0, real_t a1, real_t b0, real_t b1,
+    real_t& lo, real_t& hi)
+{
+    real_t p[4] = { a0 * b0, a0 * b1, a1 * b0, a1 * b1 };
+    lo = hi = p[0];
+    for (int i = 0; i < 4; i++) {
+        if (p[i] != p[i])
+            return false;
+        lo = std::min(lo, p[i]);
+        hi = std::max(hi, p[i]);
+    }
+    return true;
+}
+
+bool BoundingBox::hit(const Packet& packet, real_t t0, real_t t1) const
+{
+    real_t enter = t0, exit = t1;
+    for (int a = 0; a < 3; a++) {
+        real_t near_plane, far_plane;
+        // Rays along this axis go both ways, so the slab gives no bound.
+        if (packet.inv_min[a] >= 0) {
+            near_plane = lowCoord[a];
+            far_plane = highCoord[a];
+        }
+        else if (packet.inv_max[a] <= 0) {
+            near_plane = highCoord[a];
+            far_plane = lowCoord[a];
+        }
+        else
+            continue;
+
+        real_t lo, hi, unused;
+        if (!interval_mul(near_plane - packet.e_max[a], near_plane - packet.e_min[a],
+            packet.inv_min[a], packet.inv_max[a], lo, unused))
+            continue;
+        if (!interval_mul(far_plane - packet.e_max[a], far_plane - packet.e_min[a],
+            packet.inv_min[a], packet.inv_max[a], unused, hi))
+            continue;
+
+        enter = std::max(enter, lo);
+        exit = std::min(exit, hi);
+    }
+
+    // Same slop as the per-ray test, scaled since the kernels work in float.
+    return enter <= exit + 1e-5 * (1 + fabs(exit));
+}
+
 bool BoundingBox::hit(const Vector3& invDir, const Vector3& origin, real_t t0, real_t t1, const uint32_t dirIsNeg[3])const
 {
     float tmin =  (operator[](    dirIsNeg[0]).x - origin.x) * invDir.x;
@@ -41,6 +41,10 @@ public:
     // Packet
     void hit(const Packet& packet, int start, int end, float *t0, float *t1, char *result) const;
 
+    // Conservative test with the packet's interval bounds. False means
+    // no ray of the packet can hit the box within [t0, t1].
+    bool hit(const Packet& packet, real_t t0, real_t t1) const;
+
     int MaximumExtent()const;
     Vector3 lowCoord, highCoord;
     inline real_t SurfaceArea() {
@@ -6,7 +6,10 @@
 #include <omp.h>
 
 #include <map>
-#include "scene/hit_ispc.h"
+#include "hit_ispc.h"
+#include "scene/sphere.hpp"
+#include "scene/triangle.hpp"
+#include "scene/model.hpp"
 
 //#define printf(...) 
 using namespace std;
@@ -53,7 +56,7 @@ namespace _462 {
         delete node;
     }
 
-    void initPrimitiveInfoList(const std::vector<Geometry*>& primitives, PrimitiveInfoList& list, bool allocateOnly = false);
+    void initPrimitiveInfoList(const std::vector<BoundingBox>& bounds, PrimitiveInfoList& list, bool allocateOnly = false);
     void AddBox(const PrimitiveInfoList& buildData, uint32_t start, uint32_t end, BoundingBox & box);
     void AddCentroid(const PrimitiveInfoList& buildData, uint32_t start, uint32_t end, BoundingBox & box);
 
@@ -78,23 +81,64 @@ namespace _462 {
 
     BVHAccel::BVHAccel(const vector<Geometry*>& geometries, uint32_t mp, const string &sm):nodes(NULL), root(NULL)
     {
-        time_t startTime = SDL_GetTicks();
+        maxPrimsInNode = min(255u, mp);
 
-        printf("Building BVH...\n");
+        vector<BoundingBox> bounds(geometries.size());
+        primitives.resize(geometries.size());
+        for (uint32_t i = 0; i < geometries.size(); i++) {
+            bounds[i] = geometries[i]->bb;
+            primitives[i] = prims.add(geometries[i]);
+        }
+        build(bounds);
+        prims.reorder(primitives);
+    }
 
+    BVHAccel::BVHAccel(const Mesh* mesh, uint32_t mp, const string &sm):nodes(NULL), root(NULL)
+    {
         maxPrimsInNode = min(255u, mp);
-        primitives = geometries;
+        prims.mesh = mesh;
+
+        // Planar quads enter the build as one primitive.
+        uint32_t count = mesh->num_triangles();
+        vector<BoundingBox> bounds;
+        bounds.reserve(count);
+        primitives.reserve(count);
+        for (uint32_t i = 0; i < count; i++) {
+            BoundingBox bb;
+            mesh->get_triangle_bounds(i, &bb);
+            if (mesh->is_quad[i]) {
+                BoundingBox second;
+                mesh->get_triangle_bounds(i + 1, &second);
+                bb.AddBox(second);
+                primitives.push_back(make_prim_ref(PRIM_MESH_QUAD, i));
+                i++;
+            }
+            else
+                primitives.push_back(make_prim_ref(PRIM_MESH_TRIANGLE, i));
+            bounds.push_back(bb);
+        }
+        build(bounds);
+    }
+
+    // bounds[i] is the box of primitives[i]; on return primitives is in
+    // leaf order.
+    void BVHAccel::build(const vector<BoundingBox>& bounds)
+    {
+        time_t startTime = SDL_GetTicks();
+
+        printf("Building BVH...\n");
 	printf("Triangles: %d\n", primitives.size());
 
+        poolPtr[0] = NULL;
         if (primitives.size() == 0)
             return;
 
         // Initialize _buildData_ array for primitives
         PrimitiveInfoList buildData;
-        initPrimitiveInfoList(primitives, buildData);
+        initPrimitiveInfoList(bounds, buildData);
 
         uint32_t totalNodes = 0;
-        vector< Geometry* > orderedPrims(primitives.size());
+        vector< uint32_t > orderedPrims(primitives.size());
 
         queueData rootData = {0, static_cast<uint32_t>(primitives.size()),NULL, BoundingBox(), true, NULL };
         rootData.status = new char;
@@ -229,6 +273,14 @@ namespace _462 {
             printf("%ld/%ld ", idle[i], idleX[i]);
         printf("%d\n",totalNodes);
 
+        if (totalNodes > MAX_BVH_NODES) {
+            // an unlinked tree would lose subtrees on stack overflow, so
+            // leave it empty rather than render it wrong
+            printf("BVH has %u nodes, at most %u are supported\n", totalNodes, MAX_BVH_NODES);
+            clearList(buildData);
+            return;
+        }
+
         // Compute representation of depth-first traversal of BVH tree
         nodes = new LinearBVHNode[totalNodes];
 
@@ -267,7 +319,7 @@ namespace _462 {
 
     //TODO:convert into #define to check for perf improvement?
     void BVHAccel::buildLeaf(PrimitiveInfoList &buildData, uint32_t start,
-        uint32_t end, vector<Geometry* > &orderedPrims, BVHBuildNode *node, const BoundingBox& bbox)
+        uint32_t end, vector<uint32_t > &orderedPrims, BVHBuildNode *node, const BoundingBox& bbox)
     {
         GetTime(primitiveStart);
         for (uint32_t i = start; i < end; ++i)
@@ -289,7 +341,7 @@ namespace _462 {
 
     BVHBuildNode *BVHAccel::recursiveBuild( PrimitiveInfoList &buildData, uint32_t start,
         uint32_t end, BoundingBox *boxPtr, uint32_t *totalNodes, 
-        vector<Geometry* > &orderedPrims, BVHBuildNode *parent, bool firstChild) {
+        vector<uint32_t > &orderedPrims, BVHBuildNode *parent, bool firstChild) {
             if (start == end)
                 printf("%d %d\n", start, end);
             assert(start != end);
@@ -513,7 +565,7 @@ finishUp:
 
     BVHBuildNode *BVHAccel::fastRecursiveBuild( PrimitiveInfoList &buildData, uint32_t start,
         uint32_t end, BoundingBox *boxPtr, uint32_t *totalNodes,
-        vector<Geometry* > &orderedPrims, BVHBuildNode *parent, bool firstChild) {
+        vector<uint32_t > &orderedPrims, BVHBuildNode *parent, bool firstChild) {
             assert(end-start>100);
 
             GetTime(startTime);
@@ -729,10 +781,17 @@ finishUp:
             return node;
     }
 
-    uint32_t BVHAccel::flattenBVHTree(BVHBuildNode *node, uint32_t *offset)
+    void BVHAccel::setPrimitiveRefs(const vector<uint32_t>& refs)
+    {
+        assert(refs.size() == primitives.size());
+        primitives = refs;
+    }
+
+    uint32_t BVHAccel::flattenBVHTree(BVHBuildNode *node, uint32_t *offset, uint32_t parent)
     {
         LinearBVHNode *linearNode = &nodes[*offset];
         linearNode->bounds = node->bounds;
+        linearNode->parentOffset = parent;
         uint32_t myOffset = (*offset)++;
         if (node->nPrimitives > 0) {
             assert(!node->children[0] && !node->children[1]);
@@ -743,41 +802,86 @@ finishUp:
             // Creater interior flattened BVH node
             linearNode->axis = node->splitAxis;
             linearNode->nPrimitives = 0;
-            flattenBVHTree(node->children[0], offset);
-            linearNode->secondChildOffset = flattenBVHTree(node->children[1], offset);
+            flattenBVHTree(node->children[0], offset, myOffset);
+            linearNode->secondChildOffset = flattenBVHTree(node->children[1], offset, myOffset);
         }
         return myOffset;
     }
 
+    uint32_t BVHAccel::nextByParent(uint32_t nodeNum, const uint32_t dirIsNeg[3]) const
+    {
+        while (nodeNum != 0) {
+            uint32_t parent = nodes[nodeNum].parentOffset;
+            const LinearBVHNode *node = &nodes[parent];
+            uint32_t nearChild = dirIsNeg[node->axis] ? node->secondChildOffset : parent + 1;
+            if (nodeNum == nearChild)
+                return dirIsNeg[node->axis] ? parent + 1 : node->secondChildOffset;
+            nodeNum = parent;
+        }
+        return NO_ENTRY;
+    }
+
+    bool BVHAccel::nextNode(ShortStack<uint32_t, TRAVERSAL_STACK_SIZE>& todo, uint32_t* nodeNum,
+        const uint32_t dirIsNeg[3]) const
+    {
+        if (todo.pop(nodeNum))
+            return true;
+        if (todo.dropped == 0)
+            return false;
+        // the deepest dropped entry is the one the parent links lead to
+        todo.dropped--;
+        *nodeNum = nextByParent(*nodeNum, dirIsNeg);
+        return *nodeNum != NO_ENTRY;
+    }
+
+    bool BVHAccel::nextNode(ShortStack<TraversalNode, TRAVERSAL_STACK_SIZE>& todo, uint32_t* nodeNum,
+        uint32_t* active, const uint32_t dirIsNeg[3]) const
+    {
+        TraversalNode next;
+        if (todo.pop(&next)) {
+            *nodeNum = next.node_index;
+            *active = next.active;
+            return true;
+        }
+        if (todo.dropped == 0)
+            return false;
+        // the first active ray of a dropped entry is lost, so every ray is
+        // tested again from there
+        todo.dropped--;
+        *nodeNum = nextByParent(*nodeNum, dirIsNeg);
+        *active = 0;
+        return *nodeNum != NO_ENTRY;
+    }
+
+    template <BVHAccel::HitQuery Q, bool UseFrustum>
     uint32_t BVHAccel::getFirstHit(const Packet& packet, const BoundingBox& box, uint32_t active,
 				   uint32_t *dirIsNeg, real_t t0, real_t t1, 
-				   const vector<hitRecord>& records, bool fullRecord) const {
-            Ray active_ray = packet.rays[active];
-            Vector3 invDir(1.f / active_ray.d.x, 1.f / active_ray.d.y, 1.f / active_ray.d.z);
-            dirIsNeg[0] = invDir.x < 0;
-            dirIsNeg[1] = invDir.y < 0;
-            dirIsNeg[2] = invDir.z < 0;
-
-            if ( (fullRecord || records[active].t>=1 ) && box.hit(invDir, active_ray.e, t0, t1, dirIsNeg))
+				   const hitRecord* records) const {
+            packet.get_dir_is_neg(active, dirIsNeg);
+
+            // an any-hit ray is done once it is occluded (t < 1)
+            if ( (Q == QUERY_CLOSEST || records[active].t>=1 ) &&
+                box.hit(packet.inv_direction(active), packet.origin(active), t0, t1, dirIsNeg))
                 return active;
-            if (packet.frustum.isValid && !box.hit(packet.frustum))
+            if (UseFrustum && !box.hit(packet.frustum))
+                return packet.size;
+            if (!box.hit(packet, t0, t1))
                 return packet.size;
 
 #ifdef ISPC_RENDER	    
-	    int val = ispc::hit(packet.e_x, packet.e_y, packet.e_z, packet.d_x,packet.d_y,packet.d_z, 
-				t0, t1, (double*)&(box.lowCoord), (double*)&(box.highCoord), 
+	    int val = ispc::hit(packet.e_x, packet.e_y, packet.e_z, packet.inv_x, packet.inv_y, packet.inv_z,
+				packet.sign, packet.coherent ? packet.octant : -1,
+				t0, t1, (real_t*)&(box.lowCoord), (real_t*)&(box.highCoord), 
 				active+1, packet.size, false, NULL);
 
 	    return val;
 #else
+	    uint32_t curIsNeg[3];
 	    for (uint32_t i = active+1; i < packet.size; i++) {
-		Ray cur_ray = packet.rays[i];
-		Vector3 invDir(1.f / cur_ray.d.x, 1.f / cur_ray.d.y, 1.f / cur_ray.d.z);
-		dirIsNeg[0] = invDir.x < 0;
-		dirIsNeg[1] = invDir.y < 0;
-		dirIsNeg[2] = invDir.z < 0;
+		packet.get_dir_is_neg(i, curIsNeg);
 
-		if ( (fullRecord || records[i].t>=1 ) && box.hit(invDir, cur_ray.e, t0, t1, dirIsNeg))
+		if ( (Q == QUERY_CLOSEST || records[i].t>=1 ) &&
+		    box.hit(packet.inv_direction(i), packet.origin(i), t0, t1, curIsNeg))
 		    return i;
 	    }
 
@@ -785,29 +889,25 @@ finishUp:
 #endif
     }
 
+    template <BVHAccel::HitQuery Q>
     uint32_t BVHAccel::getLastHit(const Packet& packet, const BoundingBox& box, uint32_t active,
-        uint32_t *dirIsNeg, real_t t0, real_t t1, const vector<hitRecord>& records, bool fullRecord) const {
-            Ray active_ray = packet.rays[active];
-            Vector3 invDir(1.f / active_ray.d.x, 1.f / active_ray.d.y, 1.f / active_ray.d.z);
-            dirIsNeg[0] = invDir.x < 0;
-            dirIsNeg[1] = invDir.y < 0;
-            dirIsNeg[2] = invDir.z < 0;
+        uint32_t *dirIsNeg, real_t t0, real_t t1, const hitRecord* records) const {
+            packet.get_dir_is_neg(active, dirIsNeg);
 
 #ifdef ISPC_RENDER	    
-	    int val = ispc::hitLast(packet.e_x, packet.e_y, packet.e_z, packet.d_x,packet.d_y,packet.d_z, 
-				t0, t1, (double*)&(box.lowCoord), (double*)&(box.highCoord), 
+	    int val = ispc::hitLast(packet.e_x, packet.e_y, packet.e_z, packet.inv_x, packet.inv_y, packet.inv_z,
+				packet.sign, packet.coherent ? packet.octant : -1,
+				t0, t1, (real_t*)&(box.lowCoord), (real_t*)&(box.highCoord), 
 				active+1, packet.size);
 
 	    return val;
 #else
+            uint32_t curIsNeg[3];
             for (uint32_t i = packet.size - 1; i > active; i--) {
-                Ray cur_ray = packet.rays[i];
-                Vector3 invDir(1.f / cur_ray.d.x, 1.f / cur_ray.d.y, 1.f / cur_ray.d.z);
-                dirIsNeg[0] = invDir.x < 0;
-                dirIsNeg[1] = invDir.y < 0;
-                dirIsNeg[2] = invDir.z < 0;
+                packet.get_dir_is_neg(i, curIsNeg);
 
-                if ( (fullRecord || records[i].t>=1 ) && box.hit(invDir, cur_ray.e, t0, t1, dirIsNeg))
+                if ( (Q == QUERY_CLOSEST || records[i].t>=1 ) &&
+                    box.hit(packet.inv_direction(i), packet.origin(i), t0, t1, curIsNeg))
                     return i+1;
             }
 
@@ -823,24 +923,119 @@ finishUp:
 		*bb_ptr = nodes[0].bounds;
 	}
 
-    void BVHAccel::hit(const Packet& packet, const real_t t0, const real_t t1, vector<hitRecord>& records, bool fullRecord) const
+    uint32_t BVHAccel::findEntryNode(const Frustum& frustum) const
+    {
+        if (!nodes || !frustum.isValid)
+            return 0;
+        if (!nodes[0].bounds.hit(frustum))
+            return NO_ENTRY;
+
+        uint32_t nodeNum = 0;
+        while (nodes[nodeNum].nPrimitives == 0) {
+            uint32_t first = nodeNum + 1;
+            uint32_t second = nodes[nodeNum].secondChildOffset;
+            bool hitFirst = nodes[first].bounds.hit(frustum);
+            bool hitSecond = nodes[second].bounds.hit(frustum);
+
+            if (hitFirst && hitSecond)
+                break;
+            if (!hitFirst && !hitSecond)
+                return NO_ENTRY;
+            nodeNum = hitFirst ? first : second;
+        }
+        return nodeNum;
+    }
+
+    void BVHAccel::hit(const Packet& packet, const real_t t0, const real_t t1, hitRecord* records, bool fullRecord) const
     {
         if(!nodes || packet.size==0)
             return ;
 
-        TraversalNode stack[64]; // fixed size?
-        uint32_t todoOffset = 0;
-        uint32_t nodeNum = 0;
+        // Start below the top levels when the packet has a frustum.
+        uint32_t nodeNum = findEntryNode(packet.frustum);
+        if (nodeNum == NO_ENTRY) {
+            for (uint32_t i = 0; i < packet.size; i++)
+                records[i].t = -1;
+            return ;
+        }
+
+        for (uint32_t i = 0; i < packet.size; i++)
+            records[i].t = t1*2;
+
+        // Rays that do not share an octant gain little from packet
+        // traversal, so they go through the interleaved scalar path.
+        if (!packet.coherent && !packet.frustum.isValid) {
+            FrameArena& arena = FrameArena::local();
+            FrameArena::Scope scope(arena);
+            Ray* rays = arena.alloc<Ray>(packet.size);
+            real_t* t0s = arena.alloc<real_t>(packet.size);
+            real_t* t1s = arena.alloc<real_t>(packet.size);
+            for (uint32_t i = 0; i < packet.size; i++) {
+                rays[i] = packet.get_ray(i);
+                t0s[i] = t0;
+                t1s[i] = t1;
+            }
+            if (fullRecord)
+                traverseBatch<QUERY_CLOSEST>(rays, t0s, t1s, packet.size, records);
+            else
+                traverseBatch<QUERY_ANY>(rays, t0s, t1s, packet.size, records);
+        }
+        else
+            traversePacket(packet, nodeNum, t0, t1, records, fullRecord);
+
+        // Set t value of rays that miss all prim to negative.
+        // So we can go early out function getColor
+        for (uint32_t i = 0; i < packet.size; i++) {
+            records[i].t = (records[i].t >= t1 - 1e-3) ? -1 :
+                records[i].t;
+        }
+    }
+
+    void BVHAccel::hitPacket(const Packet& packet, const real_t t0, hitRecord* records, bool fullRecord) const
+    {
+        if(!nodes || packet.size==0)
+            return ;
+
+        uint32_t nodeNum = findEntryNode(packet.frustum);
+        if (nodeNum != NO_ENTRY)
+            traversePacket(packet, nodeNum, t0, 0, records, fullRecord);
+    }
+
+    void BVHAccel::traversePacket(const Packet& packet, uint32_t nodeNum, const real_t t0, const real_t t1,
+        hitRecord* records, bool fullRecord) const
+    {
+        if (fullRecord) {
+            if (packet.frustum.isValid)
+                traversePacket<QUERY_CLOSEST, true>(packet, nodeNum, t0, t1, records);
+            else
+                traversePacket<QUERY_CLOSEST, false>(packet, nodeNum, t0, t1, records);
+        }
+        else {
+            if (packet.frustum.isValid)
+                traversePacket<QUERY_ANY, true>(packet, nodeNum, t0, t1, records);
+            else
+                traversePacket<QUERY_ANY, false>(packet, nodeNum, t0, t1, records);
+        }
+    }
+
+    template <BVHAccel::HitQuery Q, bool UseFrustum>
+    void BVHAccel::traversePacket(const Packet& packet, uint32_t nodeNum, const real_t t0, const real_t t1,
+        hitRecord* records) const
+    {
+        const bool fullRecord = (Q == QUERY_CLOSEST);
+        ShortStack<TraversalNode, TRAVERSAL_STACK_SIZE> stack;
         uint32_t active = 0;
 
         uint32_t dirIsNeg[3];
         real_t t1_max = t1;
 
-        for (uint32_t i = 0; i < packet.size; i++)
-            records[i].t = t1*2;
+        // Children are visited in the order of the first ray, so the parent
+        // links can tell which one was taken first.
+        uint32_t orderIsNeg[3];
+        packet.get_dir_is_neg(0, orderIsNeg);
 
-        
-	    real_t* t1s = new real_t[packet.size];
+        FrameArena::Scope scope(FrameArena::local());
+        real_t* t1s = FrameArena::local().alloc<real_t>(packet.size);
 
         while (true) {
             const LinearBVHNode *node = &nodes[nodeNum];
@@ -851,12 +1046,12 @@ finishUp:
                 t1_max = std::max(t1_max, records[i].t);
             }
 
-            uint32_t cur_active = getFirstHit(packet, node->bounds, active, dirIsNeg, t0, t1_max, records, fullRecord);
+            uint32_t cur_active = getFirstHit<Q, UseFrustum>(packet, node->bounds, active, dirIsNeg, t0, t1_max, records);
 
             if (cur_active < packet.size) {
                 if (node->nPrimitives == 0) {
                     int todo_index;
-                    if (dirIsNeg[node->axis]) {
+                    if (orderIsNeg[node->axis]) {
                         todo_index = nodeNum + 1;
                         nodeNum = node->secondChildOffset;
                     }
@@ -866,104 +1061,450 @@ finishUp:
                     }
                     active = cur_active;
 
-                    TraversalNode stack_node(todo_index, cur_active);
-                    stack[todoOffset++] = stack_node;
-                    assert(todoOffset<64);
+                    stack.push(TraversalNode(todo_index, cur_active));
                 }
                 else {
-					uint32_t lastActive = getLastHit(packet, node->bounds, active, dirIsNeg, t0, t1_max, records, fullRecord);
+					uint32_t lastActive = getLastHit<Q>(packet, node->bounds, active, dirIsNeg, t0, t1_max, records);
 #ifdef ISPC_RENDER
                     for (uint32_t i = active; i < lastActive; i++)
                         t1s[i] = records[i].t;
 
                     for (uint32_t j = 0; j < node->nPrimitives; j++) {
-                        primitives[node->primitivesOffset + j]->hitPacket(packet, active, lastActive, t0, t1s, records, fullRecord);
+                        prims.hitPacket(primitives[node->primitivesOffset + j], packet, active, lastActive, t0, t1s, records, fullRecord);
                     }
 #else
                     for (uint32_t i = active; i < lastActive; i++) {
+                        if (Q == QUERY_ANY && records[i].t < 1)
+                            continue;
+                        Ray ray = packet.get_ray(i);
                         for (uint32_t j = 0; j < node->nPrimitives; j++) {
-                            // Use full record, since we still don't know how to deal with shadow ray (yet).
-                            
-                            primitives[node->primitivesOffset + j]->hit(packet.rays[i], t0, records[i].t, records[i], fullRecord);
+                            prims.hit(primitives[node->primitivesOffset + j], ray, t0, records[i].t, records[i], fullRecord);
                         }
                     }
 #endif
 
-                    if (todoOffset == 0)
+                    if (!nextNode(stack, &nodeNum, &active, orderIsNeg))
                         break;
-                    nodeNum = stack[--todoOffset].node_index;
-                    active = stack[todoOffset].active;
                 }
             }
             else {
-                if (todoOffset == 0)
+                if (!nextNode(stack, &nodeNum, &active, orderIsNeg))
                     break;
-                nodeNum = stack[--todoOffset].node_index;
-                active = stack[todoOffset].active;
             }
         }
+    }
 
-        delete[] t1s;
-        // Set t value of rays that miss all prim to negative.
-        // So we can go early out function getColor
-        for (uint32_t i = 0; i < packet.size; i++) {
-            records[i].t = (records[i].t >= t1 - 1e-3) ? -1 :
-                records[i].t;
+    uint32_t PrimitiveArrays::add(Geometry* g)
+    {
+        if (const Sphere* sphere = dynamic_cast<const Sphere*>(g)) {
+            // a non-uniform scale makes an ellipsoid, which needs the
+            // object-space test
+            if (sphere->scale.x == sphere->scale.y && sphere->scale.x == sphere->scale.z) {
+                sphere_x.push_back(sphere->position.x);
+                sphere_y.push_back(sphere->position.y);
+                sphere_z.push_back(sphere->position.z);
+                sphere_r.push_back(sphere->radius * fabs(sphere->scale.x));
+                spheres.push_back(sphere);
+                return make_prim_ref(PRIM_SPHERE, spheres.size() - 1);
+            }
+        }
+        else if (const Triangle* tri = dynamic_cast<const Triangle*>(g)) {
+            for (int k = 0; k < 3; k++) {
+                tri_v0[k].push_back(tri->bake_v0[k]);
+                tri_e1[k].push_back(tri->bake_e1[k]);
+                tri_e2[k].push_back(tri->bake_e2[k]);
+            }
+            triangles.push_back(tri);
+            return make_prim_ref(PRIM_TRIANGLE, triangles.size() - 1);
+        }
+        else if (const Model* model = dynamic_cast<const Model*>(g)) {
+            instances.push_back(model);
+            return make_prim_ref(PRIM_INSTANCE, instances.size() - 1);
+        }
+
+        geometries.push_back(g);
+        return make_prim_ref(PRIM_GEOMETRY, geometries.size() - 1);
+    }
+
+    template <typename T>
+    static void permute(vector<T>& v, const vector<uint32_t>& order)
+    {
+        vector<T> ordered(v.size());
+        for (uint32_t i = 0; i < order.size(); i++)
+            ordered[i] = v[order[i]];
+        v.swap(ordered);
+    }
+
+    void PrimitiveArrays::reorder(vector<uint32_t>& refs)
+    {
+        // order[kind][i] is the old index of the i-th entry of that kind
+        vector<uint32_t> order[PRIM_INSTANCE + 1];
+        for (uint32_t i = 0; i < refs.size(); i++) {
+            uint32_t kind = prim_kind(refs[i]);
+            if (kind == PRIM_MESH_TRIANGLE || kind == PRIM_MESH_QUAD)
+                continue;
+            order[kind].push_back(prim_index(refs[i]));
+            refs[i] = make_prim_ref(kind, order[kind].size() - 1);
+        }
+
+        permute(geometries, order[PRIM_GEOMETRY]);
+
+        permute(sphere_x, order[PRIM_SPHERE]);
+        permute(sphere_y, order[PRIM_SPHERE]);
+        permute(sphere_z, order[PRIM_SPHERE]);
+        permute(sphere_r, order[PRIM_SPHERE]);
+        permute(spheres, order[PRIM_SPHERE]);
+
+        for (int k = 0; k < 3; k++) {
+            permute(tri_v0[k], order[PRIM_TRIANGLE]);
+            permute(tri_e1[k], order[PRIM_TRIANGLE]);
+            permute(tri_e2[k], order[PRIM_TRIANGLE]);
+        }
+        permute(triangles, order[PRIM_TRIANGLE]);
+
+        permute(instances, order[PRIM_INSTANCE]);
+    }
+
+    // Same roots as Sphere::hit, solved in world space; the ray transform
+    // is affine, so t agrees with the object-space test.
+    static inline bool intersect_sphere(const Vector3& c, real_t R, const Ray& r,
+        real_t t0, real_t t1, real_t* t)
+    {
+        Vector3 ec = r.e - c;
+        real_t A = dot(r.d, r.d);
+        real_t B = 2 * dot(r.d, ec);
+        real_t C = dot(ec, ec) - R * R;
+        real_t D = B * B - 4 * A * C;
+        if (D < 0)
+            return false;
+
+        *t = (-B - sqrt(D)) / (2 * A);
+        if (*t < t0)
+            *t = (-B + sqrt(D)) / (2 * A);
+        return !(*t < t0 || *t > t1);
+    }
+
+    bool PrimitiveArrays::hit(uint32_t ref, const Ray& r, real_t t0, real_t t1, hitRecord& h, bool fullRecord) const
+    {
+        uint32_t index = prim_index(ref);
+        switch (prim_kind(ref)) {
+        case PRIM_SPHERE: {
+            Vector3 c(sphere_x[index], sphere_y[index], sphere_z[index]);
+            real_t t;
+            if (!intersect_sphere(c, sphere_r[index], r, t0, t1, &t))
+                return false;
+            h.t = t;
+            h.shape_ptr = (Geometry*)spheres[index];
+            return true;
+        }
+        case PRIM_TRIANGLE: {
+            Vector3 v0(tri_v0[0][index], tri_v0[1][index], tri_v0[2][index]);
+            Vector3 e1(tri_e1[0][index], tri_e1[1][index], tri_e1[2][index]);
+            Vector3 e2(tri_e2[0][index], tri_e2[1][index], tri_e2[2][index]);
+            real_t t, beta, gamma;
+            if (!Triangle::intersect(r, v0, e1, e2, t0, t1, &t, &beta, &gamma))
+                return false;
+            h.t = t;
+            h.shape_ptr = (Geometry*)triangles[index];
+            h.beta = beta;
+            h.gamma = gamma;
+            return true;
+        }
+        case PRIM_INSTANCE:
+            return instances[index]->Model::hit(r, t0, t1, h, fullRecord);
+        case PRIM_MESH_TRIANGLE:
+            return mesh->hit_triangle(index, r, t0, t1, h);
+        case PRIM_MESH_QUAD:
+            return mesh->hit_quad(index, r, t0, t1, h);
+        default:
+            return geometries[index]->hit(r, t0, t1, h, fullRecord);
         }
     }
 
-    Geometry* BVHAccel::hit(const Ray& ray, const real_t t0, const real_t t1, hitRecord& h, bool fullRecord) const
+    bool PrimitiveArrays::hitSpheres(uint32_t first, uint32_t count, const Ray& r, real_t t0, real_t t1,
+        hitRecord& h, bool fullRecord) const
     {
-        if(!nodes) return NULL;
+        float e[3], d[3];
+        r.e.to_array(e);
+        r.d.to_array(d);
+
+        real_t t;
+        int closest = ispc::hit_spheres(e, d, t0, t1,
+            (float*)&sphere_x[0], (float*)&sphere_y[0], (float*)&sphere_z[0], (float*)&sphere_r[0],
+            first, first + count, &t);
+        if (closest < 0)
+            return false;
+
+        h.t = t;
+        h.shape_ptr = (Geometry*)spheres[closest];
+        return true;
+    }
+
+    void PrimitiveArrays::hitPacket(uint32_t ref, const Packet& packet, int start, int end, real_t t0, real_t *t1,
+        hitRecord* hs, bool fullRecord) const
+    {
+        uint32_t index = prim_index(ref);
+        switch (prim_kind(ref)) {
+        case PRIM_SPHERE: {
+            FrameArena::Scope scope(FrameArena::local());
+            int *hit_flag = FrameArena::local().alloc<int>(end - start);
+
+            ispc::hit_sphere(packet.e_x, packet.e_y, packet.e_z, packet.d_x, packet.d_y, packet.d_z,
+                t0, t1, sphere_x[index], sphere_y[index], sphere_z[index], sphere_r[index],
+                start, end, hit_flag);
+
+            for (int i = start; i < end; i++) {
+                if (hit_flag[i - start]) {
+                    hs[i].t = t1[i];
+                    hs[i].shape_ptr = (Geometry*)spheres[index];
+                }
+            }
+            break;
+        }
+        case PRIM_TRIANGLE: {
+            float v0[3], e1[3], e2[3];
+            for (int k = 0; k < 3; k++) {
+                v0[k] = tri_v0[k][index];
+                e1[k] = tri_e1[k][index];
+                e2[k] = tri_e2[k][index];
+            }
+
+            FrameArena& arena = FrameArena::local();
+            FrameArena::Scope scope(arena);
+            float *bary_u = arena.alloc<float>(end - start);
+            float *bary_v = arena.alloc<float>(end - start);
+            int *hit_flag = arena.alloc<int>(end - start);
+
+            ispc::hit_triangle(packet.e_x, packet.e_y, packet.e_z, packet.d_x, packet.d_y, packet.d_z,
+                t0, t1, v0, e1, e2, start, end, hit_flag, bary_u, bary_v);
+
+            for (int i = start; i < end; i++) {
+                if (hit_flag[i - start]) {
+                    hs[i].t = t1[i];
+                    hs[i].shape_ptr = (Geometry*)triangles[index];
+                    hs[i].beta = bary_u[i - start];
+                    hs[i].gamma = bary_v[i - start];
+                }
+            }
+            break;
+        }
+        case PRIM_INSTANCE:
+            instances[index]->Model::hitPacket(packet, start, end, t0, t1, hs, fullRecord);
+            break;
+        case PRIM_MESH_TRIANGLE:
+            mesh->hit_triangle(index, packet, start, end, t0, t1, hs);
+            break;
+        case PRIM_MESH_QUAD:
+            mesh->hit_quad(index, packet, start, end, t0, t1, hs);
+            break;
+        default:
+            geometries[index]->hitPacket(packet, start, end, t0, t1, hs, fullRecord);
+            break;
+        }
+    }
+
+    bool BVHAccel::hit(const Ray& ray, const real_t t0, const real_t t1, hitRecord& h, bool fullRecord) const
+    {
+        return fullRecord ? traverseRay<QUERY_CLOSEST>(ray, t0, t1, h) :
+            traverseRay<QUERY_ANY>(ray, t0, t1, h);
+    }
+
+    void BVHAccel::hit(const Ray* rays, const real_t* t0, const real_t* t1, uint32_t n,
+        hitRecord* records, bool fullRecord) const
+    {
+        for (uint32_t i = 0; i < n; i++)
+            records[i].t = -1;
+        if (!nodes || n == 0)
+            return ;
+
+        if (fullRecord)
+            traverseBatch<QUERY_CLOSEST>(rays, t0, t1, n, records);
+        else
+            traverseBatch<QUERY_ANY>(rays, t0, t1, n, records);
+    }
+
+    void BVHAccel::LeafHit::fill(hitRecord& h) const
+    {
+        h.t = t;
+        h.shape_ptr = shape_ptr;
+        h.prim_id = prim_id;
+        h.beta = beta;
+        h.gamma = gamma;
+    }
+
+    template <BVHAccel::HitQuery Q>
+    bool BVHAccel::hitLeaf(const LinearBVHNode *node, const Ray& ray, const real_t t0, real_t *minT,
+        hitRecord& h1, LeafHit& best) const
+    {
+        const bool fullRecord = (Q == QUERY_CLOSEST);
+        bool found = false;
+        for (uint32_t i = 0; i < node->nPrimitives; ++i)
+        {
+            const uint32_t* refs = &primitives[node->primitivesOffset + i];
+
+            // The spheres of a leaf are neighbours in the sphere
+            // arrays, so a run of them is tested in one call.
+            uint32_t run = 1;
+            if (prim_kind(refs[0]) == PRIM_SPHERE)
+                while (i + run < node->nPrimitives && prim_kind(refs[run]) == PRIM_SPHERE)
+                    run++;
+
+            bool isHit = (run > 1) ?
+                prims.hitSpheres(prim_index(refs[0]), run, ray, t0, *minT, h1, fullRecord) :
+                prims.hit(refs[0], ray, t0, *minT, h1, fullRecord);
+            i += run - 1;
+
+            if (isHit && *minT > h1.t)
+            {
+                found = true;
+                *minT = h1.t;
+                best.t = h1.t;
+                best.shape_ptr = h1.shape_ptr;
+                best.prim_id = h1.prim_id;
+                best.beta = h1.beta;
+                best.gamma = h1.gamma;
+                if(Q == QUERY_ANY) return true;
+            }
+        }
+        return found;
+    }
+
+    template <BVHAccel::HitQuery Q>
+    bool BVHAccel::traverseRay(const Ray& ray, const real_t t0, const real_t t1, hitRecord& h) const
+    {
+        if(!nodes) return false;
         Vector3 invDir(1.f / ray.d.x, 1.f / ray.d.y, 1.f / ray.d.z);
         uint32_t dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
         // Follow ray through BVH nodes to find primitive intersections
-        uint32_t todoOffset = 0, nodeNum = 0;
-        uint32_t todo[64];
+        uint32_t nodeNum = 0;
+        ShortStack<uint32_t, TRAVERSAL_STACK_SIZE> todo;
 
         real_t minT = t1;
-        hitRecord h1;
-        Geometry* obj = NULL;
+        bool found = false;
+        hitRecord scratch;
+        LeafHit best;
         while (true) {
             const LinearBVHNode *node = &nodes[nodeNum];
             // Check ray against BVH node
             //if (node->bounds.hit(ray, t0, minT)) {
             if (node->bounds.hit(invDir,ray.e, t0, minT,dirIsNeg)) {
                 if (node->nPrimitives > 0) {
-
-                    for (uint32_t i = 0; i < node->nPrimitives; ++i)
-                    {
-                        if (primitives[node->primitivesOffset+i]->hit(ray, t0, minT, h1, fullRecord))
-                        {
-                            if(minT>h1.t)
-                            {
-                                obj = primitives[node->primitivesOffset+i];
-                                minT = h1.t;
-                                h = h1;
-                                if(!fullRecord) return obj;
-                            }
-                        }
+                    if (hitLeaf<Q>(node, ray, t0, &minT, scratch, best)) {
+                        found = true;
+                        if(Q == QUERY_ANY) break;
                     }
-                    if (todoOffset == 0) break;
-                    nodeNum = todo[--todoOffset];
+                    if (!nextNode(todo, &nodeNum, dirIsNeg)) break;
                 }
                 else {
                     // Put far BVH node on _todo_ stack, advance to near node
                     if (dirIsNeg[node->axis]) {
-                        todo[todoOffset++] = nodeNum + 1;
+                        todo.push(nodeNum + 1);
                         nodeNum = node->secondChildOffset;
                     }
                     else {
-                        todo[todoOffset++] = node->secondChildOffset;
+                        todo.push(node->secondChildOffset);
                         nodeNum = nodeNum + 1;
                     }
                 }
             }
             else {
-                if (todoOffset == 0) break;
-                nodeNum = todo[--todoOffset];
+                if (!nextNode(todo, &nodeNum, dirIsNeg)) break;
+            }
+        }
+        if (found)
+            best.fill(h);
+        return found;
+    }
+
+    struct BVHAccel::BatchRay {
+        Ray ray;
+        Vector3 invDir;
+        uint32_t dirIsNeg[3];
+        // ray and record index in the batch, NO_ENTRY for an empty slot
+        uint32_t index;
+        uint32_t nodeNum;
+        real_t t0, minT;
+        bool found;
+        LeafHit best;
+        ShortStack<uint32_t, TRAVERSAL_STACK_SIZE> todo;
+    };
+
+    template <BVHAccel::HitQuery Q>
+    bool BVHAccel::stepBatchRay(BatchRay& b, hitRecord& scratch) const
+    {
+        const LinearBVHNode *node = &nodes[b.nodeNum];
+        if (node->bounds.hit(b.invDir, b.ray.e, b.t0, b.minT, b.dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                if (hitLeaf<Q>(node, b.ray, b.t0, &b.minT, scratch, b.best)) {
+                    b.found = true;
+                    if (Q == QUERY_ANY)
+                        return false;
+                }
+            }
+            else {
+                if (b.dirIsNeg[node->axis]) {
+                    b.todo.push(b.nodeNum + 1);
+                    b.nodeNum = node->secondChildOffset;
+                }
+                else {
+                    b.todo.push(node->secondChildOffset);
+                    b.nodeNum = b.nodeNum + 1;
+                }
+                _mm_prefetch((const char*)&nodes[b.nodeNum], _MM_HINT_T0);
+                return true;
+            }
+        }
+        if (!nextNode(b.todo, &b.nodeNum, b.dirIsNeg))
+            return false;
+        _mm_prefetch((const char*)&nodes[b.nodeNum], _MM_HINT_T0);
+        return true;
+    }
+
+    template <BVHAccel::HitQuery Q>
+    void BVHAccel::traverseBatch(const Ray* rays, const real_t* t0, const real_t* t1, uint32_t n,
+        hitRecord* records) const
+    {
+        BatchRay batch[BATCH_SIZE];
+        hitRecord scratch;
+        uint32_t next = 0, live = 0;
+
+        for (uint32_t k = 0; k < BATCH_SIZE; k++)
+            batch[k].index = NO_ENTRY;
+
+        _mm_prefetch((const char*)&nodes[0], _MM_HINT_T0);
+        while (true) {
+            // refill finished slots, so up to BATCH_SIZE rays stay in flight
+            for (uint32_t k = 0; k < BATCH_SIZE && next < n; k++) {
+                BatchRay& b = batch[k];
+                if (b.index != NO_ENTRY)
+                    continue;
+                b.index = next++;
+                b.ray = rays[b.index];
+                b.invDir = Vector3(1.f / b.ray.d.x, 1.f / b.ray.d.y, 1.f / b.ray.d.z);
+                b.dirIsNeg[0] = b.invDir.x < 0;
+                b.dirIsNeg[1] = b.invDir.y < 0;
+                b.dirIsNeg[2] = b.invDir.z < 0;
+                b.nodeNum = 0;
+                b.t0 = t0[b.index];
+                b.minT = t1[b.index];
+                b.found = false;
+                b.todo = ShortStack<uint32_t, TRAVERSAL_STACK_SIZE>();
+                live++;
+            }
+            if (live == 0)
+                break;
+
+            for (uint32_t k = 0; k < BATCH_SIZE; k++) {
+                BatchRay& b = batch[k];
+                if (b.index == NO_ENTRY)
+                    continue;
+                if (!stepBatchRay<Q>(b, scratch)) {
+                    if (b.found)
+                        b.best.fill(records[b.index]);
+                    b.index = NO_ENTRY;
+                    live--;
+                }
             }
         }
-        return obj;
     }
 }/* _462 */
@@ -27,8 +27,13 @@ namespace _462 {
     const int MAX_THREADS = 128;
 
     class Geometry;
+    class Sphere;
+    class Triangle;
+    class Model;
+    class Mesh;
     struct hitRecord;
     struct Packet;
+    struct Frustum;
 
     struct BVHBuildNode
     {
@@ -174,10 +179,17 @@ namespace _462 {
             uint32_t secondChildOffset;   // interior
         };
 
-        uint8_t nPrimitives;  // 0 -> interior node
-        uint8_t axis;         // interior node: xyz
-        uint8_t pad[2];       // ensure 32 byte total size
+        // The parent link shares the word of the count and axis, so a
+        // node stays the bounds plus 8 bytes: 32 with REAL_FLOAT.
+        uint32_t nPrimitives : 8;     // 0 -> interior node
+        uint32_t axis : 2;            // interior node: xyz
+        uint32_t parentOffset : 22;   // the root is its own parent
     };
+    static_assert(sizeof(LinearBVHNode) == sizeof(BoundingBox) + 8,
+        "LinearBVHNode must stay the bounds plus two words");
+
+    // trees with more nodes cannot link every node to its parent
+    const uint32_t MAX_BVH_NODES = 1u << 22;
 
     struct TraversalNode {
         uint32_t node_index;
@@ -193,6 +205,93 @@ namespace _462 {
         }
     };
 
+    // Traversal stack of fixed size N (a power of two). When full, a push
+    // overwrites the oldest entry and counts it in dropped; traversal
+    // recovers dropped entries from the parent links, so trees of any
+    // depth are safe with a stack that stays small.
+    template <typename T, uint32_t N>
+    struct ShortStack {
+        T items[N];
+        uint32_t top;
+        uint32_t held;
+        uint32_t dropped;
+
+        ShortStack() : top(0), held(0), dropped(0) { }
+
+        void push(const T& item) {
+            items[top++ & (N - 1)] = item;
+            if (held == N)
+                dropped++;
+            else
+                held++;
+        }
+        bool pop(T* item) {
+            if (held == 0)
+                return false;
+            held--;
+            *item = items[--top & (N - 1)];
+            return true;
+        }
+    };
+
+    static const uint32_t TRAVERSAL_STACK_SIZE = 16;
+
+    // A BVH leaf refers to its primitives by tagged index: the kind sits in
+    // the top bits and selects the array in PrimitiveArrays that the low
+    // bits index, so leaves hold 4 bytes per primitive and no pointers.
+    enum PrimitiveKind {
+        PRIM_GEOMETRY = 0,      // any Geometry, through its virtual hit
+        PRIM_MESH_TRIANGLE,     // triangle of PrimitiveArrays::mesh
+        PRIM_SPHERE,            // uniformly scaled Sphere
+        PRIM_TRIANGLE,          // standalone Triangle
+        PRIM_INSTANCE,          // Model
+        PRIM_MESH_QUAD          // planar quad of PrimitiveArrays::mesh,
+                                // indexed by its first triangle
+    };
+    const uint32_t PRIM_KIND_SHIFT = 28;
+    const uint32_t PRIM_INDEX_MASK = (1u << PRIM_KIND_SHIFT) - 1;
+
+    inline uint32_t make_prim_ref(uint32_t kind, uint32_t index) {
+        return (kind << PRIM_KIND_SHIFT) | index;
+    }
+    inline uint32_t prim_kind(uint32_t ref) { return ref >> PRIM_KIND_SHIFT; }
+    inline uint32_t prim_index(uint32_t ref) { return ref & PRIM_INDEX_MASK; }
+
+    // The primitives a BVH is built over, one array per kind, dispatched on
+    // the reference tag instead of through Geometry's virtual calls. The
+    // intersection data of spheres and triangles is kept as float streams;
+    // the object pointers are only touched to shade a hit.
+    struct PrimitiveArrays {
+        std::vector<Geometry*> geometries;
+        const Mesh* mesh;
+
+        // world-space centers and radii
+        std::vector<float> sphere_x, sphere_y, sphere_z, sphere_r;
+        std::vector<const Sphere*> spheres;
+
+        // baked first vertex and edges, see Triangle::bake_v0
+        std::vector<float> tri_v0[3], tri_e1[3], tri_e2[3];
+        std::vector<const Triangle*> triangles;
+
+        std::vector<const Model*> instances;
+
+        PrimitiveArrays() : mesh(NULL) { }
+
+        // Files g under the most specific kind and returns its reference.
+        uint32_t add(Geometry* g);
+        // Permutes every array into the order refs first use its entries
+        // and rewrites refs to match, so leaf neighbours are array neighbours.
+        void reorder(std::vector<uint32_t>& refs);
+
+        bool hit(uint32_t ref, const Ray& r, real_t t0, real_t t1, hitRecord& h, bool fullRecord) const;
+        void hitPacket(uint32_t ref, const Packet& packet, int start, int end, real_t t0, real_t *t1,
+            hitRecord* hs, bool fullRecord) const;
+        // r against spheres [first, first + count) in one SIMD pass; only the
+        // closest is shaded.
+        bool hitSpheres(uint32_t first, uint32_t count, const Ray& r, real_t t0, real_t t1,
+            hitRecord& h, bool fullRecord) const;
+    };
+
 #ifdef ISPC_SOA
     typedef ispc::BVHPrimitiveInfoList PrimitiveInfoList;
 #elif defined(ISPC_AOS)
@@ -208,36 +307,126 @@ namespace _462 {
     public:
         BVHAccel(const std::vector<Geometry*>& geometries, uint32_t maxPrims = 1,
             const std::string &sm = "sah");
+        // Builds over the triangles of an indexed mesh, in mesh space. Hits
+        // only fill t, prim_id and the barycentrics; the caller shades them.
+        BVHAccel(const Mesh* mesh, uint32_t maxPrims = 1,
+            const std::string &sm = "sah");
 
         ~BVHAccel();
 
-        void threadedSubtreeBuild(PrimitiveInfoList &buildData, std::vector< Geometry* > &orderedPrims, uint32_t *totalNodes);
-        Geometry* hit(const Ray& r, const real_t t0, const real_t t1, hitRecord& h, bool fullRecord) const;
-        void hit(const Packet& packet, const real_t t0, const real_t t1, std::vector<hitRecord>& records, bool fullRecord) const;
+        void threadedSubtreeBuild(PrimitiveInfoList &buildData, std::vector< uint32_t > &orderedPrims, uint32_t *totalNodes);
+        bool hit(const Ray& r, const real_t t0, const real_t t1, hitRecord& h, bool fullRecord) const;
+        void hit(const Packet& packet, const real_t t0, const real_t t1, hitRecord* records, bool fullRecord) const;
+        // n unrelated rays, ray i over [t0[i], t1[i]], traced interleaved so
+        // node fetches of one ray overlap with work on the others. Misses
+        // get a negative t.
+        void hit(const Ray* rays, const real_t* t0, const real_t* t1, uint32_t n,
+            hitRecord* records, bool fullRecord) const;
+        // Packet traversal for nested hierarchies: records[i].t already holds
+        // the closest hit of ray i, and only rays that find a closer one
+        // have their record overwritten. Misses are not marked.
+        void hitPacket(const Packet& packet, const real_t t0, hitRecord* records, bool fullRecord) const;
 		void get_bounding_box(BoundingBox *bb_ptr);
 
+        // Primitive references in leaf order.
+        const std::vector<uint32_t>& getPrimitiveRefs() const { return primitives; }
+        // Replaces the leaf references, for owners that have permuted their
+        // primitive arrays into leaf order. refs must keep the same kinds.
+        void setPrimitiveRefs(const std::vector<uint32_t>& refs);
+
+        // Deepest node whose subtree holds every node the frustum touches,
+        // or NO_ENTRY if the frustum misses the whole tree.
+        uint32_t findEntryNode(const Frustum& frustum) const;
+        static const uint32_t NO_ENTRY = 0xffffffff;
+
     private:
+        void build(const std::vector<BoundingBox>& bounds);
         BVHBuildNode *recursiveBuild(PrimitiveInfoList &buildData, uint32_t start, uint32_t end,
             BoundingBox *boxPtr, uint32_t *totalNodes,
-            std::vector<Geometry*> &orderedPrims, BVHBuildNode *parent = NULL,
+            std::vector<uint32_t> &orderedPrims, BVHBuildNode *parent = NULL,
             bool firstChild = true);
         BVHBuildNode *fastRecursiveBuild(PrimitiveInfoList &buildData, uint32_t start, uint32_t end,
             BoundingBox *boxPtr, 
-            uint32_t *totalNodes, std::vector<Geometry*> &orderedPrims, BVHBuildNode *parent = NULL, bool firstChild = true);
+            uint32_t *totalNodes, std::vector<uint32_t> &orderedPrims, BVHBuildNode *parent = NULL, bool firstChild = true);
         void buildLeaf(PrimitiveInfoList &buildData, uint32_t start,
-            uint32_t end, std::vector<Geometry* > &orderedPrims, BVHBuildNode *node, const BoundingBox& bbox);
-        uint32_t flattenBVHTree(BVHBuildNode *node, uint32_t *offset);
+            uint32_t end, std::vector<uint32_t > &orderedPrims, BVHBuildNode *node, const BoundingBox& bbox);
+        uint32_t flattenBVHTree(BVHBuildNode *node, uint32_t *offset, uint32_t parent = 0);
+
+        // Far child of the nearest ancestor whose near child (by dirIsNeg)
+        // holds nodeNum: the node a full stack would pop next. NO_ENTRY
+        // if there is none.
+        uint32_t nextByParent(uint32_t nodeNum, const uint32_t dirIsNeg[3]) const;
+        // Moves nodeNum on to the next node to visit, from the stack or
+        // from the parent links. Returns false when traversal is done.
+        bool nextNode(ShortStack<uint32_t, TRAVERSAL_STACK_SIZE>& todo, uint32_t* nodeNum,
+            const uint32_t dirIsNeg[3]) const;
+        bool nextNode(ShortStack<TraversalNode, TRAVERSAL_STACK_SIZE>& todo, uint32_t* nodeNum,
+            uint32_t* active, const uint32_t dirIsNeg[3]) const;
+
+        // Traversal is specialized at compile time on the query, so the
+        // inner loops carry no fullRecord or frustum branches. The public
+        // entry points pick the instance once per call.
+        enum HitQuery {
+            // closest hit, recording what shade needs to find it again
+            QUERY_CLOSEST,
+            // any hit before t1; only t is meaningful (shadow rays)
+            QUERY_ANY
+        };
+
+        // The part of a hit traversal keeps per ray; the record is filled
+        // from it once the closest hit is known.
+        struct LeafHit {
+            real_t t;
+            Geometry *shape_ptr;
+            uint32_t prim_id;
+            real_t beta, gamma;
+
+            void fill(hitRecord& h) const;
+        };
 
+        template <HitQuery Q>
+        bool traverseRay(const Ray& r, const real_t t0, const real_t t1, hitRecord& h) const;
+        // Tests r against the primitives of a leaf, keeping the closest hit
+        // below *minT in best; scratch takes each primitive's result.
+        // Returns true if best was updated.
+        template <HitQuery Q>
+        bool hitLeaf(const LinearBVHNode *node, const Ray& r, const real_t t0, real_t *minT,
+            hitRecord& scratch, LeafHit& best) const;
+
+        // Interleaved traversal for unrelated rays: BATCH_SIZE rays are
+        // in flight, each advances one node per turn and prefetches the
+        // node it needs next, so a cache miss on one ray overlaps with
+        // work on the others. Only hits write records.
+        struct BatchRay;
+        static const uint32_t BATCH_SIZE = 8;
+        template <HitQuery Q>
+        void traverseBatch(const Ray* rays, const real_t* t0, const real_t* t1, uint32_t n,
+            hitRecord* records) const;
+        // One node of b's traversal; false once b is done.
+        template <HitQuery Q>
+        bool stepBatchRay(BatchRay& b, hitRecord& scratch) const;
+
+        void traversePacket(const Packet& packet, uint32_t nodeNum, const real_t t0, const real_t t1,
+            hitRecord* records, bool fullRecord) const;
+
+        template <HitQuery Q, bool UseFrustum>
+        void traversePacket(const Packet& packet, uint32_t nodeNum, const real_t t0, const real_t t1,
+            hitRecord* records) const;
+
+        template <HitQuery Q, bool UseFrustum>
         uint32_t getFirstHit(const Packet& packet, const BoundingBox& box, uint32_t active,
-            uint32_t *dirIsNeg, real_t t0, real_t t1, const std::vector<hitRecord>& records, bool fullRecord) const;
+            uint32_t *dirIsNeg, real_t t0, real_t t1, const hitRecord* records) const;
 
+        template <HitQuery Q>
         uint32_t getLastHit(const Packet& packet, const BoundingBox& box, uint32_t active, 
-            uint32_t *dirIsNeg, real_t t0, real_t t1, const std::vector<hitRecord>& records, bool fullRecord) const;
+            uint32_t *dirIsNeg, real_t t0, real_t t1, const hitRecord* records) const;
 
         uint32_t maxPrimsInNode;
         enum SplitMethod { SPLIT_MIDDLE, SPLIT_EQUAL_COUNTS, SPLIT_SAH };
         SplitMethod splitMethod;
-        std::vector<Geometry*> primitives;
+        PrimitiveArrays prims;
+        // tagged references, see make_prim_ref
+        std::vector<uint32_t> primitives;
         LinearBVHNode *nodes;
         BVHBuildNode *root;
         std::priority_queue<queueData> pq;
@@ -70,9 +70,9 @@ namespace _462 {
 		
     }
     
-    void initPrimitiveInfoList(const std::vector<Geometry*>& primitives, PrimitiveInfoList& list, bool allocateOnly)
+    void initPrimitiveInfoList(const std::vector<BoundingBox>& bounds, PrimitiveInfoList& list, bool allocateOnly)
     {
-        uint32_t N = primitives.size();
+        uint32_t N = bounds.size();
         list.primitiveNumber =  new uint32_t[N];
         list.centroidx       =  new float[N];
         list.centroidy       =  new float[N];
@@ -88,7 +88,7 @@ namespace _462 {
         list.primCount = N;
         if(!allocateOnly)for(uint32_t i=0; i<N; i++)
         {
-            Vector3 centroid = primitives[i]->bb.centroid();
+            Vector3 centroid = bounds[i].centroid();
             list.primitiveNumber[i] = i;
 
             list.centroidx[i] = centroid.x;
@@ -96,13 +96,13 @@ namespace _462 {
             list.centroidz[i] = centroid.z;
             
             
-            list.lowCoordx[i] =  primitives[i]->bb.lowCoord.x;
-            list.lowCoordy[i] =  primitives[i]->bb.lowCoord.y;
-            list.lowCoordz[i] =  primitives[i]->bb.lowCoord.z;
+            list.lowCoordx[i] =  bounds[i].lowCoord.x;
+            list.lowCoordy[i] =  bounds[i].lowCoord.y;
+            list.lowCoordz[i] =  bounds[i].lowCoord.z;
             
-            list.highCoordx[i] =  primitives[i]->bb.highCoord.x;
-            list.highCoordy[i] =  primitives[i]->bb.highCoord.y;
-            list.highCoordz[i] =  primitives[i]->bb.highCoord.z;
+            list.highCoordx[i] =  bounds[i].highCoord.x;
+            list.highCoordy[i] =  bounds[i].highCoord.y;
+            list.highCoordz[i] =  bounds[i].highCoord.z;
         }
     }
     void AddBox(const PrimitiveInfoList& buildData, uint32_t index, BoundingBox & box)
@@ -94,22 +94,22 @@ namespace _462 {
 	}
     }
     
-    void initPrimitiveInfoList(const std::vector<Geometry*>& primitives, PrimitiveInfoList& list, bool allocateOnly)
+    void initPrimitiveInfoList(const std::vector<BoundingBox>& bounds, PrimitiveInfoList& list, bool allocateOnly)
     {
-        list.resize(primitives.size());
+        list.resize(bounds.size());
         if(!allocateOnly)
             #pragma omp parallel for 
-	        for (int i = 0; i < primitives.size(); ++i) {
+	        for (int i = 0; i < bounds.size(); ++i) {
 		        #ifndef ISPC_AOS
-		        list[i] = PrimitiveInfo(i, primitives[i]->bb);
+		        list[i] = PrimitiveInfo(i, bounds[i]);
 		        #else
 		
 		        float packed_num;
 		        memcpy(&packed_num, &i, sizeof(int));
-		        Vector4 low_num(primitives[i]->bb.lowCoord, packed_num);
-		        Vector4 high(primitives[i]->bb.highCoord, 0.f);
-		        Vector4 centroid(.5f * primitives[i]->bb.lowCoord +
-				         .5f * primitives[i]->bb.highCoord, 0);
+		        Vector4 low_num(bounds[i].lowCoord, packed_num);
+		        Vector4 high(bounds[i].highCoord, 0.f);
+		        Vector4 centroid(.5f * bounds[i].lowCoord +
+				         .5f * bounds[i].highCoord, 0);
 
 		        to_ispc_vector<ispc::float4, Vector4, 4>(list[i].lowCoord, low_num);
 		        to_ispc_vector<ispc::float4, Vector4, 4>(list[i].highCoord, -high);
@@ -7,6 +7,7 @@
  */
 
 #include "scene/mesh.hpp"
+#include "scene/triangle.hpp"
 #include "application/opengl.hpp"
 #include <iostream>
 #include <cstring>
@@ -39,6 +40,8 @@ struct TriIndex
 struct Face
 {
     TriIndex v[3];
+    // first half of a quad face, the next face is the second
+    bool quad;
 };
 
 enum ObjFormat
@@ -53,15 +56,22 @@ Mesh::Mesh()
 {
     has_tcoords = false;
     has_normals = false;
+    bvh = NULL;
 }
 
-Mesh::~Mesh() { }
+Mesh::~Mesh()
+{
+    if ( bvh ) {
+        delete bvh;
+        bvh = NULL;
+    }
+}
 
 bool Mesh::load()
 {
 	if (filename.length() == 0 &&
 		triangles.size() > 0)
-		return true;
+		return initialize();
 
     std::cout << "Loading mesh from '" << filename << "'..." << std::endl;
 #ifdef _WINDOWS
@@ -236,11 +246,11 @@ bool Mesh::load()
                 tri[i].tcoord--;
             }
 
-            Face f1 = { { tri[0], tri[1], tri[2] } };
+            Face f1 = { { tri[0], tri[1], tri[2] }, num_vertex == 4 };
             face_list.push_back( f1 );
 
             if ( num_vertex == 4 ) {
-                Face f2 = { { tri[2], tri[3], tri[0] } };
+                Face f2 = { { tri[2], tri[3], tri[0] }, false };
                 face_list.push_back( f2 );
             }
 
@@ -279,6 +289,8 @@ bool Mesh::load()
 
     triangles.reserve( face_list.size() );
     vertices.reserve( face_list.size() * 2 );
+    is_quad.clear();
+    is_quad.reserve( face_list.size() );
 
     // current vertex index, for creating new vertices
     unsigned int vert_idx_counter = 0;
@@ -304,6 +316,7 @@ bool Mesh::load()
             tri.vertices[j] = rv.first->second;
         }
         triangles.push_back( tri );
+        is_quad.push_back( face.quad );
     }
 
 	initialize();
@@ -354,29 +367,7 @@ bool Mesh::create_gl_data()
 
     // compute normals if needed
     if ( !has_normals ) {
-        // first zero out
-        for ( size_t i = 0; i < vertices.size(); ++i ) {
-            vertices[i].normal = Vector3::Zero();
-        }
-
-        // then sum in all triangle normals
-        for ( size_t i = 0; i < triangles.size(); ++i ) {
-            Vector3 pos[3];
-            for ( size_t j = 0; j < 3; ++j ) {
-                pos[j] = vertices[triangles[i].vertices[j]].position;
-            }
-            Vector3 normal = normalize( cross( pos[1] - pos[0], pos[2] - pos[0] ) );
-            for ( size_t j = 0; j < 3; ++j ) {
-                vertices[triangles[i].vertices[j]].normal += normal;
-            }
-        }
-
-        // then normalize
-        for ( size_t i = 0; i < vertices.size(); ++i ) {
-            vertices[i].normal = normalize( vertices[i].normal );
-        }
-
-        has_normals = true;
+        compute_normals();
     }
 
     // build vertex data
@@ -408,9 +399,375 @@ void Mesh::render() const
     glDrawElements( GL_TRIANGLES, index_data.size(), GL_UNSIGNED_INT, &index_data[0] );
 }
 
+void Mesh::compute_normals()
+{
+    // first zero out
+    for ( size_t i = 0; i < vertices.size(); ++i ) {
+        vertices[i].normal = Vector3::Zero();
+    }
+
+    // then sum in all triangle normals
+    for ( size_t i = 0; i < triangles.size(); ++i ) {
+        Vector3 pos[3];
+        for ( size_t j = 0; j < 3; ++j ) {
+            pos[j] = vertices[triangles[i].vertices[j]].position;
+        }
+        Vector3 normal = normalize( cross( pos[1] - pos[0], pos[2] - pos[0] ) );
+        for ( size_t j = 0; j < 3; ++j ) {
+            vertices[triangles[i].vertices[j]].normal += normal;
+        }
+    }
+
+    // then normalize
+    for ( size_t i = 0; i < vertices.size(); ++i ) {
+        vertices[i].normal = normalize( vertices[i].normal );
+    }
+
+    has_normals = true;
+}
+
 bool Mesh::initialize()
 {
+    if ( vertices.empty() || triangles.empty() ) {
+        return false;
+    }
+
+    if ( !has_normals ) {
+        compute_normals();
+    }
+
+    build_streams();
+    check_quads();
+
+    if ( bvh ) {
+        delete bvh;
+    }
+    bvh = new BVHAccel( this );
+    reorder_to_leaves();
 	return true;
 }
 
+void Mesh::build_streams()
+{
+    positions.resize( vertices.size() * 3 );
+    normals.resize( vertices.size() * 3 );
+    tex_coords.resize( vertices.size() * 2 );
+    for ( size_t i = 0; i < vertices.size(); ++i ) {
+        vertices[i].position.to_array( &positions[i * 3] );
+        vertices[i].normal.to_array( &normals[i * 3] );
+        vertices[i].tex_coord.to_array( &tex_coords[i * 2] );
+    }
+
+    indices.resize( triangles.size() * 3 );
+    for ( size_t i = 0; i < triangles.size(); ++i ) {
+        indices[i * 3 + 0] = triangles[i].vertices[0];
+        indices[i * 3 + 1] = triangles[i].vertices[1];
+        indices[i * 3 + 2] = triangles[i].vertices[2];
+    }
+}
+
+void Mesh::reorder_to_leaves()
+{
+    // Traversal visits leaves in this order, so after the permutation the
+    // triangles of a leaf, and of neighbouring leaves, share cache lines
+    // with their vertices.
+    std::vector<uint32_t> refs = bvh->getPrimitiveRefs();
+
+    static const unsigned int UNUSED = ~0u;
+    std::vector<unsigned int> vertex_map( vertices.size(), UNUSED );
+    MeshTriangleList ordered_triangles;
+    ordered_triangles.reserve( triangles.size() );
+    std::vector<uint8_t> ordered_quads;
+    ordered_quads.reserve( triangles.size() );
+    MeshVertexList ordered_vertices;
+    ordered_vertices.reserve( vertices.size() );
+
+    for ( size_t i = 0; i < refs.size(); ++i ) {
+        uint32_t first = prim_index( refs[i] );
+        uint32_t count = prim_kind( refs[i] ) == PRIM_MESH_QUAD ? 2 : 1;
+        refs[i] = make_prim_ref( prim_kind( refs[i] ), ordered_triangles.size() );
+
+        for ( uint32_t k = 0; k < count; ++k ) {
+            MeshTriangle tri = triangles[first + k];
+            for ( size_t j = 0; j < 3; ++j ) {
+                unsigned int v = tri.vertices[j];
+                if ( vertex_map[v] == UNUSED ) {
+                    vertex_map[v] = ordered_vertices.size();
+                    ordered_vertices.push_back( vertices[v] );
+                }
+                tri.vertices[j] = vertex_map[v];
+            }
+            ordered_triangles.push_back( tri );
+            ordered_quads.push_back( count == 2 && k == 0 );
+        }
+    }
+
+    // vertices no triangle uses keep their relative order at the end
+    for ( size_t v = 0; v < vertices.size(); ++v ) {
+        if ( vertex_map[v] == UNUSED ) {
+            ordered_vertices.push_back( vertices[v] );
+        }
+    }
+
+    triangles.swap( ordered_triangles );
+    is_quad.swap( ordered_quads );
+    vertices.swap( ordered_vertices );
+    build_streams();
+    bvh->setPrimitiveRefs( refs );
+}
+
+void Mesh::check_quads()
+{
+    is_quad.resize( triangles.size(), 0 );
+
+    for ( size_t i = 0; i < triangles.size(); ++i ) {
+        if ( !is_quad[i] ) {
+            continue;
+        }
+        is_quad[i] = 0;
+
+        // the loader splits quad a b c d into (a, b, c) and (c, d, a)
+        if ( i + 1 >= triangles.size() ||
+             triangles[i + 1].vertices[0] != triangles[i].vertices[2] ||
+             triangles[i + 1].vertices[2] != triangles[i].vertices[0] ) {
+            continue;
+        }
+
+        Vector3 a = vertices[triangles[i].vertices[0]].position;
+        Vector3 b = vertices[triangles[i].vertices[1]].position;
+        Vector3 c = vertices[triangles[i].vertices[2]].position;
+        Vector3 d = vertices[triangles[i + 1].vertices[1]].position;
+
+        // planar, and both diagonals split it into consistently wound
+        // triangles, which holds only for convex quads
+        Vector3 n = cross( b - a, c - a );
+        real_t size = length( c - a );
+        if ( squared_length( n ) == 0 ||
+             fabs( dot( normalize( n ), d - a ) ) > 1e-4 * size ||
+             dot( n, cross( d - c, a - c ) ) <= 0 ||
+             dot( cross( c - b, d - b ), cross( a - d, b - d ) ) <= 0 ) {
+            continue;
+        }
+
+        is_quad[i] = 1;
+        i++;
+    }
+}
+
+void Mesh::get_triangle_bounds( uint32_t tri, BoundingBox* bb ) const
+{
+    *bb = BoundingBox();
+    for ( size_t j = 0; j < 3; ++j ) {
+        const float* p = &positions[indices[tri * 3 + j] * 3];
+        bb->AddPoint( Vector3( p[0], p[1], p[2] ) );
+    }
+}
+
+void Mesh::get_edges( uint32_t tri, float v0[3], float e1[3], float e2[3] ) const
+{
+    const float* p0 = &positions[indices[tri * 3 + 0] * 3];
+    const float* p1 = &positions[indices[tri * 3 + 1] * 3];
+    const float* p2 = &positions[indices[tri * 3 + 2] * 3];
+    for ( size_t j = 0; j < 3; ++j ) {
+        v0[j] = p0[j];
+        e1[j] = p1[j] - p0[j];
+        e2[j] = p2[j] - p0[j];
+    }
+}
+
+float Mesh::get_triangle_area( uint32_t tri ) const
+{
+    float v0[3], e1[3], e2[3];
+    get_edges( tri, v0, e1, e2 );
+    return length( cross( Vector3( e1 ), Vector3( e2 ) ) ) * 0.5f;
+}
+
+// interpolates a stream with n floats per vertex
+template< size_t N >
+static void interpolate( const std::vector<float>& stream, const uint32_t* index,
+                         real_t beta, real_t gamma, real_t out[N] )
+{
+    real_t alpha = 1 - beta - gamma;
+    for ( size_t j = 0; j < N; ++j ) {
+        out[j] = alpha * stream[index[0] * N + j] +
+                 beta * stream[index[1] * N + j] +
+                 gamma * stream[index[2] * N + j];
+    }
+}
+
+Vector3 Mesh::get_position( uint32_t tri, real_t beta, real_t gamma ) const
+{
+    real_t v[3];
+    interpolate<3>( positions, &indices[tri * 3], beta, gamma, v );
+    return Vector3( v[0], v[1], v[2] );
+}
+
+Vector3 Mesh::get_normal( uint32_t tri, real_t beta, real_t gamma ) const
+{
+    real_t v[3];
+    interpolate<3>( normals, &indices[tri * 3], beta, gamma, v );
+    return Vector3( v[0], v[1], v[2] );
+}
+
+Vector2 Mesh::get_tex_coord( uint32_t tri, real_t beta, real_t gamma ) const
+{
+    real_t v[2];
+    interpolate<2>( tex_coords, &indices[tri * 3], beta, gamma, v );
+    return Vector2( v[0], v[1] );
+}
+
+bool Mesh::hit_triangle( uint32_t tri, const Ray& r, real_t t0, real_t t1, hitRecord& h ) const
+{
+    float v0[3], e1[3], e2[3];
+    get_edges( tri, v0, e1, e2 );
+
+    real_t t, beta, gamma;
+    if ( !Triangle::intersect( r, Vector3( v0 ), Vector3( e1 ), Vector3( e2 ),
+                               t0, t1, &t, &beta, &gamma ) ) {
+        return false;
+    }
+
+    h.t = t;
+    h.prim_id = tri;
+    h.beta = beta;
+    h.gamma = gamma;
+    return true;
+}
+
+void Mesh::hit_triangle( uint32_t tri, const Packet& packet, int start, int end, real_t t0, real_t *t1,
+                         hitRecord* hs ) const
+{
+    float v0[3], e1[3], e2[3];
+    get_edges( tri, v0, e1, e2 );
+
+    FrameArena& arena = FrameArena::local();
+    FrameArena::Scope scope( arena );
+    float *bary_u = arena.alloc<float>( end - start );
+    float *bary_v = arena.alloc<float>( end - start );
+    int *hit_flag = arena.alloc<int>( end - start );
+
+    ispc::hit_triangle( packet.e_x, packet.e_y, packet.e_z, packet.d_x, packet.d_y, packet.d_z,
+                        t0, t1, v0, e1, e2, start, end, hit_flag, bary_u, bary_v );
+
+    for ( int i = start; i < end; ++i ) {
+        if ( hit_flag[i - start] ) {
+            hs[i].t = t1[i];
+            hs[i].prim_id = tri;
+            hs[i].beta = bary_u[i - start];
+            hs[i].gamma = bary_v[i - start];
+        }
+    }
+}
+
+// Ray against the planar convex quad split as (a, b, c) and (c, d, a),
+// after Lagae and Dutre: misses across the outer edges at b reject the
+// whole quad with one test. Returns the half hit and its barycentrics.
+static bool intersect_quad( const Ray& r, const Vector3& a, const Vector3& b, const Vector3& c,
+                            const Vector3& d, real_t t0, real_t t1,
+                            real_t* t, int* half, real_t* beta, real_t* gamma )
+{
+    Vector3 e01 = c - b;
+    Vector3 e03 = a - b;
+    Vector3 p = cross( r.d, e03 );
+    real_t det = dot( e01, p );
+    if ( det == 0 ) {
+        return false;
+    }
+    real_t inv_det = 1 / det;
+
+    Vector3 tv = r.e - b;
+    real_t alpha = dot( tv, p ) * inv_det;
+    if ( alpha < 0 ) {
+        return false;
+    }
+    Vector3 q = cross( tv, e01 );
+    real_t beta_q = dot( r.d, q ) * inv_det;
+    if ( beta_q < 0 ) {
+        return false;
+    }
+
+    if ( alpha + beta_q <= 1 ) {
+        // (a, b, c): weights of b and c
+        *t = dot( e03, q ) * inv_det;
+        *half = 0;
+        *beta = 1 - alpha - beta_q;
+        *gamma = alpha;
+    } else {
+        Vector3 e23 = a - d;
+        Vector3 e21 = c - d;
+        Vector3 p2 = cross( r.d, e21 );
+        real_t det2 = dot( e23, p2 );
+        if ( det2 == 0 ) {
+            return false;
+        }
+        real_t inv_det2 = 1 / det2;
+
+        Vector3 tv2 = r.e - d;
+        real_t u = dot( tv2, p2 ) * inv_det2;
+        if ( u < 0 ) {
+            return false;
+        }
+        Vector3 q2 = cross( tv2, e23 );
+        real_t v = dot( r.d, q2 ) * inv_det2;
+        if ( v < 0 || u + v > 1 ) {
+            return false;
+        }
+
+        // (c, d, a): weights of d and a
+        *t = dot( e21, q2 ) * inv_det2;
+        *half = 1;
+        *beta = 1 - u - v;
+        *gamma = u;
+    }
+
+    return *t > t0 && *t < t1;
+}
+
+bool Mesh::hit_quad( uint32_t tri, const Ray& r, real_t t0, real_t t1, hitRecord& h ) const
+{
+    const uint32_t* index = &indices[tri * 3];
+    Vector3 a( &positions[index[0] * 3] );
+    Vector3 b( &positions[index[1] * 3] );
+    Vector3 c( &positions[index[2] * 3] );
+    Vector3 d( &positions[index[4] * 3] );
+
+    real_t t, beta, gamma;
+    int half;
+    if ( !intersect_quad( r, a, b, c, d, t0, t1, &t, &half, &beta, &gamma ) ) {
+        return false;
+    }
+
+    h.t = t;
+    h.prim_id = tri + half;
+    h.beta = beta;
+    h.gamma = gamma;
+    return true;
+}
+
+void Mesh::hit_quad( uint32_t tri, const Packet& packet, int start, int end, real_t t0, real_t *t1,
+                     hitRecord* hs ) const
+{
+    const uint32_t* index = &indices[tri * 3];
+
+    FrameArena& arena = FrameArena::local();
+    FrameArena::Scope scope( arena );
+    float *bary_u = arena.alloc<float>( end - start );
+    float *bary_v = arena.alloc<float>( end - start );
+    int *hit_flag = arena.alloc<int>( end - start );
+
+    ispc::hit_quad( packet.e_x, packet.e_y, packet.e_z, packet.d_x, packet.d_y, packet.d_z,
+                    t0, t1, (float*)&positions[index[0] * 3], (float*)&positions[index[1] * 3],
+                    (float*)&positions[index[2] * 3], (float*)&positions[index[4] * 3],
+                    start, end, hit_flag, bary_u, bary_v );
+
+    for ( int i = start; i < end; ++i ) {
+        if ( hit_flag[i - start] ) {
+            hs[i].t = t1[i];
+            hs[i].prim_id = tri + hit_flag[i - start] - 1;
+            hs[i].beta = bary_u[i - start];
+            hs[i].gamma = bary_v[i - start];
+        }
+    }
+}
+
 } /* _462 */
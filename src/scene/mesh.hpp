@@ -17,6 +17,11 @@
 
 namespace _462 {
 
+class Ray;
+class BVHAccel;
+struct hitRecord;
+struct Packet;
+
 struct MeshVertex
 {
     Vector3 position;
@@ -80,10 +85,54 @@ public:
     bool has_tcoords;
     bool has_normals;
 
+    /// Builds the tracing data below from the vertex and triangle lists.
 	bool initialize();
 
+    // Tracing data: per vertex 3 position, 3 normal and 2 texture floats,
+    // per triangle 3 vertex indices. Triangles are addressed by index.
+    std::vector<float> positions;
+    std::vector<float> normals;
+    std::vector<float> tex_coords;
+    std::vector<uint32_t> indices;
+    // is_quad[i] is set if triangle i and i + 1 are the two halves of a
+    // planar convex quad, (a, b, c) and (c, d, a), traced as one primitive.
+    std::vector<uint8_t> is_quad;
+
+    // Hierarchy over the triangles in mesh space, shared by every model
+    // that instances this mesh.
+    BVHAccel* bvh;
+
+    void get_triangle_bounds(uint32_t tri, BoundingBox* bb) const;
+    float get_triangle_area(uint32_t tri) const;
+
+    /// Interpolated attributes at weights beta, gamma of vertices 1 and 2.
+    Vector3 get_position(uint32_t tri, real_t beta, real_t gamma) const;
+    Vector3 get_normal(uint32_t tri, real_t beta, real_t gamma) const;
+    Vector2 get_tex_coord(uint32_t tri, real_t beta, real_t gamma) const;
+
+    // Intersection with one triangle. A hit only sets t, prim_id, beta
+    // and gamma of the record; shading is up to the instancing model.
+    bool hit_triangle(uint32_t tri, const Ray& r, real_t t0, real_t t1, hitRecord& h) const;
+    void hit_triangle(uint32_t tri, const Packet& packet, int start, int end, real_t t0, real_t *t1,
+        hitRecord* hs) const;
+    // Same for the quad starting at triangle tri; prim_id is the half hit.
+    bool hit_quad(uint32_t tri, const Ray& r, real_t t0, real_t t1, hitRecord& h) const;
+    void hit_quad(uint32_t tri, const Packet& packet, int start, int end, real_t t0, real_t *t1,
+        hitRecord* hs) const;
+
 private:
 
+    /// Sums face normals into smooth vertex normals.
+    void compute_normals();
+    /// Fills the tracing streams from the vertex and triangle lists.
+    void build_streams();
+    /// Permutes triangles into the bvh leaf order and vertices into the
+    /// order those triangles first use them.
+    void reorder_to_leaves();
+    void get_edges(uint32_t tri, float v0[3], float e1[3], float e2[3]) const;
+    /// Keeps only the loader's quad marks whose halves form a planar convex quad.
+    void check_quads();
+
     typedef std::vector< float > FloatList;
     typedef std::vector< unsigned int > IndexList;
 
@@ -19,15 +19,8 @@
 
 namespace _462 {
 
-Model::Model() : mesh( 0 ), material( 0 ), bvh(NULL), sum_area(-1) { }
-Model::~Model()
-{ 
-	if(bvh)
-	{
-		delete bvh; 
-		bvh=NULL;
-	} 
-}
+Model::Model() : mesh( 0 ), material( 0 ), sum_area(-1) { }
+Model::~Model() { }
 
 void Model::render() const
 {
@@ -41,77 +34,79 @@ void Model::render() const
 }
 void Model::InitGeometry()
 { 
-	if(bvh)
-	{
-		delete bvh;
-		bvh = NULL;
-	}
-	
 	if (mesh == NULL)
 		return ;
 
-	triangles.clear();
-
 	Geometry::InitGeometry();
 	Matrix4 mat;
 	make_transformation_matrix(&mat, position,orientation,scale);
 	
+	bb = BoundingBox();
 	for(unsigned int i=0;i<mesh->num_vertices();i++)
 		bb.AddPoint(project(mat*Vector4(mesh->vertices[i].position,1)));
+}
 
-	std::vector<Geometry*> geometries; 
-	triangles.reserve(mesh->num_triangles());
-	
-	const MeshTriangle* mTriangles = mesh->get_triangles();
-	const MeshVertex* mVertices = mesh->get_vertices();
-
-	for(unsigned int i=0;i<mesh->num_triangles();i++)
-	{
-		Triangle t;
-		t.invMat = invMat;
-		t.normMat = normMat;
-		t.orientation = orientation;
-		t.position = position;
-		t.scale = scale;
-		t.simple = true;
-		const unsigned int vertexIndices[] = {mTriangles[i].vertices[0], mTriangles[i].vertices[1], mTriangles[i].vertices[2] };
-		MeshVertex tVertex[] = {mVertices[ vertexIndices[0] ], mVertices[ vertexIndices[1] ], mVertices[ vertexIndices[2] ] };
-		
-		for(int j=0;j<3;j++)
-		{
-			t.vertices[j].material = material;
-			t.vertices[j].position = tVertex[j].position;
-			t.vertices[j].normal = tVertex[j].normal;
-			t.vertices[j].tex_coord = tVertex[j].tex_coord;
-		}
-		t.InitGeometry();
-		triangles.push_back(t);
-		geometries.push_back(&triangles[i]);
-	}
-	bvh = new BVHAccel(geometries);
+void Model::shade(const Ray& r, hitRecord& h) const
+{
+	// The transform is affine and directions are not renormalized, so t
+	// is the same in model and world space.
+	h.p = r.e + h.t * r.d;
+
+	Vector2 texCoord = mesh->get_tex_coord(h.prim_id, h.beta, h.gamma);
+	texCoord[0] = fmod(texCoord[0],1.0);
+	texCoord[1] = fmod(texCoord[1],1.0);
+	if(texCoord[0]<0) texCoord[0]+=1;
+	if(texCoord[1]<0) texCoord[1]+=1;
+	Triangle::getMaterialProperties(h.mp, texCoord, material);
+
+	h.n = normalize(normMat * mesh->get_normal(h.prim_id, h.beta, h.gamma));
+	if (material)
+		h.bsdf_ptr = const_cast<BSDF*>(&(material->bsdf));
+
+	Vector3 x, y, z = h.n;
+	coordinate_system(z, &x, &y);
+	h.shading_trans = Matrix3(x, y, z);
+	inverse(&h.inv_shading_trans, h.shading_trans);
 }
 
-    // TODO: model's hitpacket
-void Model::hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1, std::vector<hitRecord>& hs, bool fullRecord) const {
-  
-    for(int i=start; i<end; i++)
-        bvh->hit(packet.rays[i], t0, t1[i], hs[i], fullRecord);
+void Model::hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1, hitRecord* hs, bool fullRecord) const {
+	if (!mesh || !mesh->bvh || end <= start)
+		return ;
+
+	// Move the whole range into model space once, then let the model's
+	// own BVH traverse it as a packet.
+	FrameArena::Scope scope(FrameArena::local());
+	Packet local(end - start);
+#ifdef ISPC_RENDER
+	ispc::transform_rays(packet.e_x, packet.e_y, packet.e_z, packet.d_x, packet.d_y, packet.d_z,
+		invMat._m, start, end,
+		local.e_x, local.e_y, local.e_z, local.d_x, local.d_y, local.d_z,
+		local.inv_x, local.inv_y, local.inv_z, local.sign);
+#else
+	for (int i = start; i < end; i++) {
+		Ray r = packet.get_ray(i).transform(invMat);
+		local.set_ray(i - start, r.e, r.d);
+	}
+#endif
+	local.finalize();
+
+	mesh->bvh->hitPacket(local, t0, hs + start, fullRecord);
+
+	for (int i = start; i < end; i++) {
+		if (hs[i].t < t1[i]) {
+			hs[i].shape_ptr = const_cast<Model*>(this);
+			t1[i] = hs[i].t;
+		}
+	}
 }
 
 bool Model::hit(const Ray& r, const real_t t0, const real_t t1,hitRecord& h, bool fullRecord) const
 {
-	if(!checkBoundingBoxHit(r,t0,t1))
+	if(!mesh || !mesh->bvh || !checkBoundingBoxHit(r,t0,t1))
 		return false;
-	bool hit = (bvh->hit(r,t0,t1,h,fullRecord) != NULL);
+	bool hit = mesh->bvh->hit(r.transform(invMat),t0,t1,h,fullRecord);
 	if (hit)
 		h.shape_ptr = const_cast<Model*>(this);
-	if (hit && fullRecord) {
-		h.bsdf_ptr = const_cast<BSDF*>(&(material->bsdf));
-		
-		Vector3 x, y, z = h.n;
-		coordinate_system(z, &x, &y);
-		h.shading_trans = Matrix3(x, y, z);
-	}
 	
 	return hit;
 }
@@ -121,30 +116,37 @@ float Model::get_area() {
 		return sum_area;
 	float area = 0;
 
-	for (unsigned int i = 0; i < triangles.size(); i++) {
-		area += triangles[i].get_area();
+	// in world space, to match the points sample returns
+	for (unsigned int i = 0; i < mesh->num_triangles(); i++) {
+		Vector3 v0 = project(transMat * Vector4(mesh->get_position(i, 0, 0), 1));
+		Vector3 v1 = project(transMat * Vector4(mesh->get_position(i, 1, 0), 1));
+		Vector3 v2 = project(transMat * Vector4(mesh->get_position(i, 0, 1), 1));
+		area += length(cross(v1 - v0, v2 - v0)) * 0.5f;
 	}
 
 	sum_area = area;
 	return area;
 }
 	
-Vector3 Model::sample(const Vector3 &p, float r1, float r2, float c, Vector3 *n_ptr) {
-	int id = (int) triangles.size() * c;
+Vector3 Model::sample(const Vector3 &, float r1, float r2, float c, Vector3 *n_ptr) {
+	int count = mesh->num_triangles();
+	int id = count * c;
 
-	if (id >= triangles.size())
-		id = triangles.size() - 1;
+	if (id >= count)
+		id = count - 1;
 
-	return triangles[id].sample(p, r1, r2, c, n_ptr);
-}
+	Vector2 tri_sample = uniform_sample_triangle(r1, r2);
+	real_t beta = tri_sample.y;
+	real_t gamma = 1 - tri_sample.x - tri_sample.y;
 
-float Model::pdf(const Vector3 &p, const Vector3 &wi) {
-	float pdf = 0.f;
-	for (uint32_t i = 0; i < triangles.size(); i++) {
-		pdf += triangles[i].get_area() * triangles[i].pdf(p, wi);
-	}
+	// the mesh is in model space
+	*n_ptr = normalize(normMat * mesh->get_normal(id, beta, gamma));
+	return project(transMat * Vector4(mesh->get_position(id, beta, gamma), 1));
+}
 
-	return pdf / get_area();
+float Model::pdf(const Vector3 &, const Vector3 &) {
+	// every triangle contributes its area times its uniform pdf of 1 / area
+	return mesh->num_triangles() / get_area();
 }
 
 } /* _462 */
@@ -15,7 +15,8 @@
 namespace _462 {
 
 /**
- * A mesh of triangles.
+ * An instance of a mesh. Rays are traced through the mesh's own BVH in
+ * mesh space, so moving the model only changes its matrices.
  */
 class Model : public Geometry
 {
@@ -29,15 +30,14 @@ public:
 
     virtual void render() const;
     virtual bool hit(const Ray& r, real_t t0, real_t t1,hitRecord& h, bool fullRecord) const;
-    virtual void hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1, std::vector<hitRecord>& hs, bool fullRecord) const;
+    virtual void hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1, hitRecord* hs, bool fullRecord) const;
+    virtual void shade(const Ray& r, hitRecord& h) const;
     virtual void InitGeometry();
 
 	virtual float get_area();
 	virtual Vector3 sample(const Vector3 &p, float r1, float r2,  float c, Vector3 *n_ptr);
 	virtual float pdf(const Vector3 &p, const Vector3 &wi);
 
-    BVHAccel* bvh;
-    std::vector<Triangle> triangles;
 private:
 	float sum_area;
 };
@@ -1,4 +1,5 @@
 #include "ray.hpp"
+#include <limits>
 
 namespace _462 {
 
@@ -34,6 +35,17 @@ Vector3 Ray::get_pixel_dir(real_t ni, real_t nj)
 {
     return normalize(dir + dist*(nj*cU + AR*ni*cR));
 }
+Vector3 Ray::offset_origin(const Vector3& p, const Vector3& n,
+                           const Vector3& w)
+{
+	// hit points carry an error of a few ulps of their largest
+	// coordinate, which is what matters once real_t is float
+	const real_t eps = std::numeric_limits<real_t>::epsilon();
+	real_t err = 64 * eps * (fabs(p.x) + fabs(p.y) + fabs(p.z)) + 1e-6;
+	Vector3 off = n * err;
+	return dot(w, n) < 0 ? p - off : p + off;
+}
+
 Ray Ray::transform(const Matrix4& mat)const
 {
 	Matrix4 nm = mat;
@@ -23,6 +23,11 @@ public:
 	Ray transform(const Matrix3& mat) const;
     static Vector3 get_pixel_dir(real_t x, real_t y);
 	static void init(const Camera& camera);
+	/*Origin for a ray leaving the surface point p (normal n) along w,
+	  pushed off the surface by the rounding error of p so that the new
+	  ray does not hit the surface it starts on*/
+	static Vector3 offset_origin(const Vector3& p, const Vector3& n,
+	                             const Vector3& w);
 };
 
 struct VisibilityTest {
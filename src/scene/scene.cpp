@@ -22,28 +22,122 @@ namespace _462 {
     time_t ta[MAX_THREADS], tb[MAX_THREADS], ts[MAX_THREADS], tt[MAX_THREADS], tu[MAX_THREADS];
 
 	Packet::Packet(size_t packet_size) {
-            rays = new Ray[packet_size];
+            // Round every stream up to a multiple of 4 floats so that each
+            // one stays 16 byte aligned inside the shared block.
+            size_t stride = (packet_size + 3) & ~(size_t)3;
+            data = (float*)FrameArena::local().alloc_bytes(sizeof(float) * stride * 9 + stride);
 
-            e_x = (float*)memalign(16, sizeof(float) * packet_size);
-            e_y = (float*)memalign(16, sizeof(float) * packet_size);
-            e_z = (float*)memalign(16, sizeof(float) * packet_size);
+            e_x = data;
+            e_y = data + stride;
+            e_z = data + stride * 2;
 
-            d_x = (float*)memalign(16, sizeof(float) * packet_size);
-            d_y = (float*)memalign(16, sizeof(float) * packet_size);
-            d_z = (float*)memalign(16, sizeof(float) * packet_size);
+            d_x = data + stride * 3;
+            d_y = data + stride * 4;
+            d_z = data + stride * 5;
+
+            inv_x = data + stride * 6;
+            inv_y = data + stride * 7;
+            inv_z = data + stride * 8;
+
+            sign = (uint8_t*)(data + stride * 9);
 
             size = packet_size;
+            coherent = false;
+            octant = 0;
         }   
 
-        Packet::~Packet() {
-            delete[] rays;
+        Packet::~Packet() { }
+
+        void Packet::set_ray(uint32_t i, const Vector3& e, const Vector3& d) {
+            e_x[i] = e.x;
+            e_y[i] = e.y;
+            e_z[i] = e.z;
+            d_x[i] = d.x;
+            d_y[i] = d.y;
+            d_z[i] = d.z;
+
+            inv_x[i] = 1.f / d_x[i];
+            inv_y[i] = 1.f / d_y[i];
+            inv_z[i] = 1.f / d_z[i];
+
+            sign[i] = (inv_x[i] < 0 ? SIGN_X : 0) |
+                (inv_y[i] < 0 ? SIGN_Y : 0) |
+                (inv_z[i] < 0 ? SIGN_Z : 0);
+        }
+
+        void Packet::finalize() {
+            coherent = size > 0;
+            octant = coherent ? sign[0] : 0;
+            for (uint32_t i = 1; i < size && coherent; i++)
+                coherent = (sign[i] == octant);
+
+            const float* e[3] = { e_x, e_y, e_z };
+            const float* inv[3] = { inv_x, inv_y, inv_z };
+            for (int a = 0; a < 3; a++) {
+                e_min[a] = inv_min[a] = FLT_MAX;
+                e_max[a] = inv_max[a] = -FLT_MAX;
+                for (uint32_t i = 0; i < size; i++) {
+                    e_min[a] = std::min(e_min[a], e[a][i]);
+                    e_max[a] = std::max(e_max[a], e[a][i]);
+                    inv_min[a] = std::min(inv_min[a], inv[a][i]);
+                    inv_max[a] = std::max(inv_max[a], inv[a][i]);
+                }
+            }
+        }
+
+        void Packet::build_shadow_frustum(const BoundingBox& target) {
+            frustum.isValid = false;
+            if (size == 0)
+                return;
+
+            // Corners of the origin box followed by corners of the target.
+            Vector3 corners[16];
+            for (int c = 0; c < 8; c++) {
+                corners[c] = Vector3((c & 1) ? e_max[0] : e_min[0],
+                    (c & 2) ? e_max[1] : e_min[1],
+                    (c & 4) ? e_max[2] : e_min[2]);
+                corners[c + 8] = Vector3(target[c & 1].x,
+                    target[(c >> 1) & 1].y, target[(c >> 2) & 1].z);
+            }
+
+            Vector3 from = 0.5 * (corners[0] + corners[7]);
+            Vector3 to = target.centroid();
+            Vector3 axis = to - from;
+            if (squared_length(axis) < 1e-12)
+                return;
+            axis = normalize(axis);
+            Vector3 u, v;
+            coordinate_system(axis, &u, &v);
+
+            // Every plane is a supporting plane of the convex hull of both
+            // boxes, so it holds all the segments. The sides are tilted from
+            // the origin box's extent to the target's to follow the bundle.
+            real_t depth = dot(axis, to - from);
+            Vector3 sides[4] = { u, -u, v, -v };
+            Vector3 normals[6] = { -axis, axis };
+            for (int k = 0; k < 4; k++) {
+                real_t ext_from = -BIG_NUMBER, ext_to = -BIG_NUMBER;
+                for (int c = 0; c < 8; c++) {
+                    ext_from = std::max(ext_from, dot(sides[k], corners[c]));
+                    ext_to = std::max(ext_to, dot(sides[k], corners[c + 8]));
+                }
+                normals[k + 2] = sides[k] - axis * ((ext_to - ext_from) / depth);
+            }
 
-            _aligned_free(e_x);
-            _aligned_free(e_y);
-            _aligned_free(e_z);
-            _aligned_free(d_x);
-            _aligned_free(d_y);
-            _aligned_free(d_z);
+            const PlanePosition position[6] = { FRONT, BACK, LEFT, RIGHT, BOTTOM, TOP };
+            for (int k = 0; k < 6; k++) {
+                const Vector3& m = normals[k];
+                real_t offset = -BIG_NUMBER;
+                for (int c = 0; c < 16; c++)
+                    offset = std::max(offset, dot(m, corners[c]));
+                // Leave room for the float rounding of the ray streams.
+                offset += 1e-5 * (1 + fabs(offset));
+
+                Plane& plane = frustum.planes[position[k]];
+                plane.norm = -m;
+                plane.point = m * (offset / squared_length(m));
+            }
+            frustum.isValid = true;
         }
 
     Geometry::Geometry():
@@ -193,34 +287,32 @@ namespace _462 {
         refractive_index = 1.0;
     }
 
-    void Scene::calculateDiffuseColors(vector<Vector3>& p,vector<hitRecord>& h, Color3* col) const
+    void Scene::calculateDiffuseColors(const Vector3* p, const hitRecord* h, int numRays, Random462* rngs, Color3* col) const
     {
-        int numRays = p.size();
-        
-        int indices[1024];
-        assert(numRays<=1024);
+        FrameArena& arena = FrameArena::local();
 		time_t startTime;
         for(unsigned int l=0;l<simple_lights.size();l++)
         {
+            FrameArena::Scope scope(arena);
             int numShadowRays = 0;
-            vector<Vector3> locs;
-            locs.reserve(numRays);
-            vector<real_t> NDotLs;
-            NDotLs.reserve(numRays);
+            int* indices = arena.alloc<int>(numRays);
+            Vector3* locs = arena.alloc<Vector3>(numRays);
+            real_t* NDotLs = arena.alloc<real_t>(numRays);
 
             startTime = SDL_GetTicks();
             for(int i=0;i<numRays;i++) if(h[i].t>=0)//check if this actually hit something
             {
 				Vector3 loc;
 				real_t NDotL;
-				real_t x = 2 * random_uniform() - 1, y = 2 * random_uniform() - 1, z = 2 * random_uniform() - 1;
+				real_t x = 2 * rngs[i].random() - 1, y = 2 * rngs[i].random() - 1,
+					z = 2 * rngs[i].random() - 1;
 				loc = simple_lights[l].position + normalize(Vector3(x,y,z)) * simple_lights[l].radius;
 				Vector3 L = normalize(loc-p[i]);
 				NDotL = dot(h[i].n,L);
 
                 if(NDotL<=0) continue;
-                locs.push_back(loc);
-                NDotLs.push_back(NDotL);
+                locs[numShadowRays] = loc;
+                NDotLs[numShadowRays] = NDotL;
                 indices[numShadowRays++] = i;
                 
             }
@@ -228,19 +320,20 @@ namespace _462 {
             Packet pkt(numShadowRays);
             for(int i=0;i<numShadowRays;i++)
             {
-                pkt.rays[i].e = p[ indices[i] ];
-				float dis = length(locs[i] - simple_lights[0].position);
-                pkt.rays[i].d = locs[i] - p[ indices[i] ];
-                pkt.e_x[i] = pkt.rays[i].e[0];
-                pkt.e_y[i] = pkt.rays[i].e[1];
-                pkt.e_z[i] = pkt.rays[i].e[2];
-                pkt.d_x[i] = pkt.rays[i].d[0];
-                pkt.d_y[i] = pkt.rays[i].d[1];
-                pkt.d_z[i] = pkt.rays[i].d[2];
+                Vector3 e = Ray::offset_origin(p[ indices[i] ], h[ indices[i] ].n,
+                                               locs[i] - p[ indices[i] ]);
+                pkt.set_ray(i, e, locs[i] - e);
             }
+            pkt.finalize();
+
+            BoundingBox light_bounds;
+            Vector3 r(simple_lights[l].radius, simple_lights[l].radius, simple_lights[l].radius);
+            light_bounds.AddPoint(simple_lights[l].position - r);
+            light_bounds.AddPoint(simple_lights[l].position + r);
+            pkt.build_shadow_frustum(light_bounds);
             tt[omp_get_thread_num()] += SDL_GetTicks()-startTime;
 
-            vector<hitRecord> hShadow(numShadowRays);
+            hitRecord* hShadow = arena.alloc<hitRecord>(numShadowRays);
 
             startTime = SDL_GetTicks();
             tree->hit(pkt, SLOP, 1 - SLOP, hShadow, false);
@@ -248,8 +341,6 @@ namespace _462 {
             
 			
             startTime = SDL_GetTicks();
-			float dis;
-			float dis2;
             for(int i=0;i<numShadowRays;i++)
             {
                 //We just want to check if something is between the point and the source
@@ -260,14 +351,6 @@ namespace _462 {
                     c /= simple_lights[l].attenuation.constant + d*simple_lights[l].attenuation.linear + d*d*simple_lights[l].attenuation.quadratic;
                     col[ indices[i] ] += h[indices[i]].mp.diffuse*c*NDotLs[ i ];
                 }
-				/*
-				else {
-					dis = length(hShadow[i].t * pkt.rays[i].d + pkt.rays[i].e - simple_lights[0].position);
-					dis2 = length(pkt.rays[i].d + pkt.rays[i].e - simple_lights[0].position);
-					Vector3 v1 = hShadow[i].t * pkt.rays[i].d + pkt.rays[i].e, v2 = pkt.rays[i].d + pkt.rays[i].e;
-					printf("%f <-> %f\n", dis, dis2);
-				}
-				*/
             }
             tt[omp_get_thread_num()] += SDL_GetTicks()-startTime;
             //average over the simulations
@@ -275,14 +358,28 @@ namespace _462 {
     }
 
 	bool Scene::hit(const Ray& r, const real_t t0, const real_t t1, hitRecord& h, bool fullRecord) const {
-		return tree->hit(r, t0, t1, h, fullRecord) != NULL;
+		return tree->hit(r, t0, t1, h, fullRecord);
 	}
 
-	void Scene::hit(const Packet& packet, const real_t t0, const real_t t1, std::vector<hitRecord>& records, bool fullRecord) const {
+	void Scene::hit(const Packet& packet, const real_t t0, const real_t t1, hitRecord* records, bool fullRecord) const {
 		return tree->hit(packet, t0, t1, records, fullRecord);
 	}
 
-    Color3 Scene::calculateDiffuseColor(Vector3 p,Vector3 n,Color3 kd) const
+	void Scene::hit(const Ray* rays, const real_t* t0, const real_t* t1, uint32_t n, hitRecord* records, bool fullRecord) const {
+		tree->hit(rays, t0, t1, n, records, fullRecord);
+	}
+
+	void Scene::shade_hit(const Ray& r, hitRecord& h) const {
+		h.shape_ptr->shade(r, h);
+	}
+
+	void Scene::shade_hit(const Packet& packet, hitRecord* records) const {
+		for (uint32_t i = 0; i < packet.size; i++)
+			if (records[i].t >= 0 && records[i].shape_ptr)
+				records[i].shape_ptr->shade(packet.get_ray(i), records[i]);
+	}
+
+    Color3 Scene::calculateDiffuseColor(Vector3 p,Vector3 n,Color3 kd,Random462& rng) const
     {
         /*Number of shadow rays fired to light source*/
         // TODO: more shadow rays to use packet?
@@ -293,7 +390,7 @@ namespace _462 {
             Color3 temp(0,0,0);
             for(int s = 0; s<sim; s++)
             {
-                real_t x = random_gaussian(), y = random_gaussian(), z = random_gaussian();
+                real_t x = rng.gaussian(), y = rng.gaussian(), z = rng.gaussian();
                 Vector3 loc = simple_lights[l].position + normalize(Vector3(x,y,z)) * simple_lights[l].radius;
 
                 Vector3 L = normalize(loc-p);
@@ -302,8 +399,8 @@ namespace _462 {
                 if(NDotL>0)
                 {
                     Ray shadowRay;
-                    shadowRay.e = p;
-                    shadowRay.d = loc-p;
+                    shadowRay.e = Ray::offset_origin(p, n, L);
+                    shadowRay.d = loc-shadowRay.e;
                     hitRecord h;
 
                     //We just want to check if something is between the point and the source
@@ -321,10 +418,10 @@ namespace _462 {
         }
         return col;
     }
-    static Ray distortRay(Ray r, real_t distortionWidth)
+    static Ray distortRay(Ray r, real_t distortionWidth, Random462& rng)
     {
         //return r;
-        real_t u = random_gaussian()*distortionWidth, v = random_gaussian()*distortionWidth;
+        real_t u = rng.gaussian()*distortionWidth, v = rng.gaussian()*distortionWidth;
         u -= distortionWidth/2;
         v -= distortionWidth/2;
 
@@ -348,10 +445,9 @@ namespace _462 {
         Ray r = Ray(camera.get_position(), Ray::get_pixel_dir(i, j));
 
         hitRecord h;
-        Geometry* obj;
-        if((obj = tree->hit(r, 0, BIG_NUMBER, h, true)))
+        if(tree->hit(r, 0, BIG_NUMBER, h, true))
         {
-            obj->Transform(translation,Vector3(0,0,0));
+            h.shape_ptr->Transform(translation,Vector3(0,0,0));
             if(tree)
             {
                 delete tree;
@@ -374,17 +470,20 @@ namespace _462 {
         }
     }
 
-    void Scene::getColors(const Packet& packet, std::vector<std::vector<real_t> >& refractiveStack, Color3* col, int depth, real_t t0, real_t t1) const 
+    void Scene::getColors(const Packet& packet, Random462* rngs, std::vector<std::vector<real_t> >& refractiveStack, Color3* col, int depth, real_t t0, real_t t1) const 
     {
-        vector<hitRecord> h(packet.size);
+        FrameArena& arena = FrameArena::local();
+        FrameArena::Scope scope(arena);
+        hitRecord* h = arena.alloc<hitRecord>(packet.size);
 
         time_t startTime = SDL_GetTicks();
         tree->hit(packet, t0, t1, h, true);
+        shade_hit(packet, h);
         ta[omp_get_thread_num()] += SDL_GetTicks()-startTime;
         //Add the ambient component
         
         startTime = SDL_GetTicks();
-        vector<Vector3> p(packet.size);
+        Vector3* p = arena.alloc<Vector3>(packet.size);
         for(int i=0;i<packet.size;i++)
         {
             if(h[i].t<0)
@@ -395,14 +494,14 @@ namespace _462 {
                     col[i] = Scene::ambient_light*h[i].mp.ambient;
 				else				
 	                col[i] = Color3(0,0,0);
-                p[i] = packet.rays[i].e + h[i].t*packet.rays[i].d;
+                p[i] = packet.origin(i) + h[i].t*packet.direction(i);
             }
         }
 
         tu[omp_get_thread_num()] += SDL_GetTicks()-startTime;
 
         startTime = SDL_GetTicks();
-        calculateDiffuseColors(p,h,col);
+        calculateDiffuseColors(p,h,packet.size,rngs,col);
         ts[omp_get_thread_num()] += SDL_GetTicks()-startTime;
         
         for(int i=0; i<packet.size;i++) if(h[i].t>=0)
@@ -414,20 +513,22 @@ namespace _462 {
                 Color3 refractedColor(0,0,0);
                 if(h[i].mp.specular!=Color3(0,0,0))
                 {
-                    Ray reflectedRay(p[i],normalize(packet.rays[i].d - 2 *dot(packet.rays[i].d,h[i].n) *h[i].n));
+                    Vector3 d = packet.direction(i);
+                    Vector3 rd = normalize(d - 2 *dot(d,h[i].n) *h[i].n);
+                    Ray reflectedRay(Ray::offset_origin(p[i],h[i].n,rd),rd);
                 
 
                     if(num_glossy_reflection_samples>0)
                     {
-                        for(int i=0;i< num_glossy_reflection_samples;i++)
+                        for(int s=0;s< num_glossy_reflection_samples;s++)
                         {
-                            Ray newRay = distortRay(reflectedRay,0.125);
-                            reflectedColor += h[i].mp.specular*getColor(newRay, refractiveStack[i], depth-1, SLOP);
+                            Ray newRay = distortRay(reflectedRay,0.125,rngs[i]);
+                            reflectedColor += h[i].mp.specular*getColor(newRay, rngs[i], refractiveStack[i], depth-1, SLOP);
                         }
                         reflectedColor /= num_glossy_reflection_samples;
                     }
                     else
-                        reflectedColor = h[i].mp.specular*getColor(reflectedRay,refractiveStack[i], depth-1, SLOP);
+                        reflectedColor = h[i].mp.specular*getColor(reflectedRay, rngs[i], refractiveStack[i], depth-1, SLOP);
                 }
 
                 //Refraction not possible
@@ -454,7 +555,7 @@ namespace _462 {
                     if(RIRatio>1)	//If entering a rarer medium, reverse normal direction
                         h[i].n*=-1;
 
-                    real_t dDotN = dot(normalize(packet.rays[i].d),h[i].n);
+                    real_t dDotN = dot(normalize(packet.direction(i)),h[i].n);
                     real_t cosSq = 1-RIRatio*RIRatio*(1-dDotN*dDotN);
 
                     if(cosSq<0)	//Total Internal Reflection
@@ -465,10 +566,10 @@ namespace _462 {
                     else
                     {
                         real_t cosTheta = sqrt(cosSq);
-                        Vector3 dir = (normalize(packet.rays[i].d) - h[i].n *dDotN)*RIRatio - h[i].n*cosTheta; 
-                        Ray refractedRay(p[i],dir);
+                        Vector3 dir = (normalize(packet.direction(i)) - h[i].n *dDotN)*RIRatio - h[i].n*cosTheta; 
+                        Ray refractedRay(Ray::offset_origin(p[i],h[i].n,dir),dir);
 
-                        refractedColor = getColor(refractedRay, refractiveStack[i], depth-1, SLOP);
+                        refractedColor = getColor(refractedRay, rngs[i], refractiveStack[i], depth-1, SLOP);
 
                         if(h[i].mp.refractive_index<currentRI)
                             cosTheta = dDotN;
@@ -484,12 +585,13 @@ namespace _462 {
         }
     }
 
-    Color3 Scene::getColor(const Ray& r, std::vector<real_t> refractiveStack, int depth, real_t t0, real_t t1) const
+    Color3 Scene::getColor(const Ray& r, Random462& rng, std::vector<real_t> refractiveStack, int depth, real_t t0, real_t t1) const
     {
         hitRecord h;
         // Invalid value.
         if(!tree->hit(r, t0, t1, h, true))
             return Scene::background_color;	//Nothing hit, return background color
+        shade_hit(r, h);
         
         //Add the ambient component
         Color3 col(0,0,0);
@@ -499,7 +601,7 @@ namespace _462 {
         //Add the diffuse component
         Vector3 p = r.e + h.t*r.d;
         if(h.mp.refractive_index == 0)
-            col += calculateDiffuseColor(p,h.n,h.mp.diffuse);
+            col += calculateDiffuseColor(p,h.n,h.mp.diffuse,rng);
 
         if(depth>0)
         {
@@ -508,20 +610,21 @@ namespace _462 {
             Color3 refractedColor(0,0,0);
             if(h.mp.specular!=Color3(0,0,0))
             {
-                Ray reflectedRay(p,normalize(r.d - 2 *dot(r.d,h.n) *h.n));
+                Vector3 rd = normalize(r.d - 2 *dot(r.d,h.n) *h.n);
+                Ray reflectedRay(Ray::offset_origin(p,h.n,rd),rd);
                 
 
                 if(num_glossy_reflection_samples>0)
                 {
                     for(int i=0;i< num_glossy_reflection_samples;i++)
                     {
-                        Ray newRay = distortRay(reflectedRay,0.125);
-                        reflectedColor += h.mp.specular*getColor(newRay, refractiveStack, depth-1, SLOP);
+                        Ray newRay = distortRay(reflectedRay,0.125,rng);
+                        reflectedColor += h.mp.specular*getColor(newRay, rng, refractiveStack, depth-1, SLOP);
                     }
                     reflectedColor /= num_glossy_reflection_samples;
                 }
                 else
-                    reflectedColor = h.mp.specular*getColor(reflectedRay,refractiveStack, depth-1, SLOP);
+                    reflectedColor = h.mp.specular*getColor(reflectedRay, rng, refractiveStack, depth-1, SLOP);
             }
 
             //Refraction not possible
@@ -560,9 +663,9 @@ namespace _462 {
                 {
                     real_t cosTheta = sqrt(cosSq);
                     Vector3 dir = (normalize(r.d) - h.n *dDotN)*RIRatio - h.n*cosTheta; 
-                    Ray refractedRay(p,dir);
+                    Ray refractedRay(Ray::offset_origin(p,h.n,dir),dir);
 
-                    refractedColor = getColor(refractedRay, refractiveStack, depth-1, SLOP);
+                    refractedColor = getColor(refractedRay, rng, refractiveStack, depth-1, SLOP);
 
                     if(h.mp.refractive_index<currentRI)
                         cosTheta = dDotN;
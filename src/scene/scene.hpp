@@ -15,6 +15,8 @@
 #include "math/camera.hpp"
 #include "scene/mesh.hpp"
 #include "scene/bvh.hpp"
+#include "math/arena.hpp"
+#include "math/random462.hpp"
 #include <string>
 #include <vector>
 #include <cfloat>
@@ -47,6 +49,11 @@ struct MaterialProp
     real_t refractive_index;
 };
 
+    /*
+    * Traversal only fills t, shape_ptr, prim_id and the barycentrics;
+    * everything from n to p is left for Scene::shade_hit, so the shading
+    * is done once for the closest hit instead of for every candidate.
+    */
     struct hitRecord
     {
         //direction of normal of the object where the ray hits
@@ -63,6 +70,11 @@ struct MaterialProp
 		Geometry *shape_ptr;
 		uint32_t depth;
 
+        // Set by indexed meshes: the triangle hit and the barycentric
+        // weights of its second and third vertex.
+        uint32_t prim_id;
+        real_t beta, gamma;
+
         hitRecord() {
             t = BIG_NUMBER;
 			shape_ptr = NULL;
@@ -86,9 +98,18 @@ struct MaterialProp
         }
     };
 
+    // Bits of Packet::sign, set when the matching direction component is negative.
+    enum RaySign { SIGN_X = 1, SIGN_Y = 2, SIGN_Z = 4 };
+
+    /*
+    * A bundle of rays stored as float streams. All streams live in one
+    * aligned block from the thread's FrameArena, so a packet must not
+    * outlive the tile (or FrameArena::Scope) it was made in. Inverse
+    * directions and octant signs are computed once in set_ray so
+    * traversal never divides by a direction.
+    */
     struct Packet {
         Frustum frustum;
-        Ray *rays;
 
         float *e_x;
         float *e_y;
@@ -97,13 +118,57 @@ struct MaterialProp
         float *d_y;
         float *d_z;
 
+        float *inv_x;
+        float *inv_y;
+        float *inv_z;
+
+        // per-ray octant mask, see RaySign
+        uint8_t *sign;
+
         uint32_t size;
 
+        // true if all rays share one octant, which is then stored in octant
+        bool coherent;
+        uint8_t octant;
+
+        // Per-axis interval bounds of the origins and reciprocal
+        // directions over all rays, used for whole-packet culling.
+        float e_min[3], e_max[3];
+        float inv_min[3], inv_max[3];
+
         Packet(size_t packet_size);
 
         ~Packet();
 
+        void set_ray(uint32_t i, const Vector3& e, const Vector3& d);
+        // Recomputes the coherence flag and interval bounds over the
+        // first size rays.
+        void finalize();
+        // Sets frustum to enclose every segment from the ray origins to
+        // target. Call after finalize(); rays must end inside target at t=1.
+        void build_shadow_frustum(const BoundingBox& target);
+
+        Vector3 origin(uint32_t i) const {
+            return Vector3(e_x[i], e_y[i], e_z[i]);
+        }
+        Vector3 direction(uint32_t i) const {
+            return Vector3(d_x[i], d_y[i], d_z[i]);
+        }
+        Vector3 inv_direction(uint32_t i) const {
+            return Vector3(inv_x[i], inv_y[i], inv_z[i]);
+        }
+        Ray get_ray(uint32_t i) const {
+            return Ray(origin(i), direction(i));
+        }
+        void get_dir_is_neg(uint32_t i, uint32_t dirIsNeg[3]) const {
+            dirIsNeg[0] = (sign[i] & SIGN_X) != 0;
+            dirIsNeg[1] = (sign[i] & SIGN_Y) != 0;
+            dirIsNeg[2] = (sign[i] & SIGN_Z) != 0;
+        }
+
     private:
+        float *data;
+
         Packet(const Packet& packet);
         Packet& operator= (const Packet& packet);
     };
@@ -142,7 +207,10 @@ struct MaterialProp
         */
         virtual void render() const = 0;
         virtual bool hit(const Ray& r, real_t t0, real_t t1, hitRecord& h, bool fullRecord) const = 0;
-        virtual void hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1, std::vector<hitRecord>& hs, bool fullRecord) const = 0;
+        virtual void hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1, hitRecord* hs, bool fullRecord) const = 0;
+        // Fills the shading part of h for a hit of the world ray r that
+        // hit or hitPacket found on this geometry.
+        virtual void shade(const Ray& r, hitRecord& h) const = 0;
         virtual void InitGeometry();
         virtual void Transform(real_t translate, const Vector3 rotate);
 		virtual float get_area() = 0;
@@ -222,14 +290,22 @@ struct MaterialProp
         //void add_light( const SphereLight& l );
 		void add_light( Light* l );
         static const int maxRecursionDepth;
-        Color3 getColor(const Ray& r, std::vector<real_t> refractiveStack, int depth = maxRecursionDepth, real_t t0 = 0, real_t t1 = 1e30) const;
-        void getColors(const Packet& packet, std::vector<std::vector<real_t> >& refractiveStack, Color3* col, int depth = maxRecursionDepth, real_t t0 = 0, real_t t1 = 1e30) const;
+        // rng is the stream of the sample the ray belongs to, rngs the
+        // stream of each ray of the packet.
+        Color3 getColor(const Ray& r, Random462& rng, std::vector<real_t> refractiveStack, int depth = maxRecursionDepth, real_t t0 = 0, real_t t1 = 1e30) const;
+        void getColors(const Packet& packet, Random462* rngs, std::vector<std::vector<real_t> >& refractiveStack, Color3* col, int depth = maxRecursionDepth, real_t t0 = 0, real_t t1 = 1e30) const;
 
         bool hit(const Ray& r, const real_t t0, const real_t t1, hitRecord& h, bool fullRecord) const;
-		void hit(const Packet& packet, const real_t t0, const real_t t1, std::vector<hitRecord>& records, bool fullRecord) const;
-
-        Color3 calculateDiffuseColor(Vector3 p, Vector3 n, Color3 kd)const;
-        void calculateDiffuseColors(std::vector<Vector3>& p, std::vector<hitRecord>& h, Color3* col) const;
+		void hit(const Packet& packet, const real_t t0, const real_t t1, hitRecord* records, bool fullRecord) const;
+		// n unrelated rays traced together; misses get a negative t
+		void hit(const Ray* rays, const real_t* t0, const real_t* t1, uint32_t n, hitRecord* records, bool fullRecord) const;
+        // Computes material, normal and shading frame of a hit returned
+        // by hit(..., true) for the same ray(s). Packet misses are skipped.
+        void shade_hit(const Ray& r, hitRecord& h) const;
+        void shade_hit(const Packet& packet, hitRecord* records) const;
+
+        Color3 calculateDiffuseColor(Vector3 p, Vector3 n, Color3 kd, Random462& rng)const;
+        void calculateDiffuseColors(const Vector3* p, const hitRecord* h, int numRays, Random462* rngs, Color3* col) const;
 
         void InitGeometry();
         void buildBVH();
@@ -112,9 +112,9 @@ void Sphere::InitGeometry()
 }
 
     // TODO: sphere's hitpacket
-void Sphere::hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1Ptr, std::vector<hitRecord>& hs, bool fullRecord) const {
+void Sphere::hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1Ptr, hitRecord* hs, bool fullRecord) const {
 	for (uint32_t i = start; i < end; i++) {
-		this->hit(packet.rays[i], t0, t1Ptr[i], hs[i], fullRecord);
+		this->hit(packet.get_ray(i), t0, t1Ptr[i], hs[i], fullRecord);
 	}
 }
 
@@ -163,7 +163,7 @@ float Sphere::pdf(const Vector3 &p, const Vector3 &wi) {
 	return uniform_sample_cone_pdf(cos_max);
 }
 
-bool Sphere::hit(const Ray& r, const real_t t0, const real_t t1, hitRecord & h, bool fullRecord) const
+bool Sphere::hit(const Ray& r, const real_t t0, const real_t t1, hitRecord & h, bool) const
 {
 	if(!checkBoundingBoxHit(r,t0,t1))
 		return false;
@@ -189,51 +189,54 @@ bool Sphere::hit(const Ray& r, const real_t t0, const real_t t1, hitRecord & h,
 	    if(t<t0 || t>t1)
 		    return false;
         h.t = t;
-	    if(fullRecord)
-		{
-			Vector3 p = e + h.t*d;
-			h.n = normalize(normMat*(p-c));
-
-			Vector3 x, y, z = h.n;
-			coordinate_system(z, &x, &y);
-
-			h.shading_trans = Matrix3(x, y, z);
-			inverse(&h.inv_shading_trans, h.shading_trans);
-
-			if (material != NULL) {
-				h.mp.diffuse = material->diffuse;
-				h.mp.ambient = material->ambient;
-				h.mp.specular = material->specular;
-				h.mp.refractive_index = material->refractive_index;
-			
-				h.mp.texColor = Color3(1,1,1);
-				if(material->get_texture_data())
-				{
-					int width,height;
-					material->get_texture_size(&width, &height );
-
-					real_t x = p.z;
-					real_t y = p.x;
-					real_t z = p.y;
-					Vector3 v = Vector3(x,y,z);
-					project( invMat*Vector4(v,1));
-
-					real_t theta = acos(v.z/radius	);
-					real_t phi = atan2(v.y,v.x);
-					if(phi<0)
-						phi += 2*PI;
-
-					h.mp.texColor = material->get_texture_pixel( (phi/(2*PI))*width, ((PI-theta)/PI)*height);
-				}
-				h.bsdf_ptr = (BSDF*)&(material->bsdf);
-			}
-		}
 		h.shape_ptr = (Geometry*)this;
-		h.p = r.d * t + r.e;
 
 		return true;
 	}
 
 }
+
+void Sphere::shade(const Ray& r, hitRecord& h) const
+{
+	Ray tRay = r.transform(invMat);
+	Vector3 c = Vector3::Zero();
+	Vector3 p = tRay.e + h.t*tRay.d;
+	h.n = normalize(normMat*(p-c));
+
+	Vector3 x, y, z = h.n;
+	coordinate_system(z, &x, &y);
+
+	h.shading_trans = Matrix3(x, y, z);
+	inverse(&h.inv_shading_trans, h.shading_trans);
+
+	if (material != NULL) {
+		h.mp.diffuse = material->diffuse;
+		h.mp.ambient = material->ambient;
+		h.mp.specular = material->specular;
+		h.mp.refractive_index = material->refractive_index;
+	
+		h.mp.texColor = Color3(1,1,1);
+		if(material->get_texture_data())
+		{
+			int width,height;
+			material->get_texture_size(&width, &height );
+
+			real_t x = p.z;
+			real_t y = p.x;
+			real_t z = p.y;
+			Vector3 v = Vector3(x,y,z);
+			project( invMat*Vector4(v,1));
+
+			real_t theta = acos(v.z/radius	);
+			real_t phi = atan2(v.y,v.x);
+			if(phi<0)
+				phi += 2*PI;
+
+			h.mp.texColor = material->get_texture_pixel( real_t((phi/(2*PI))*width), real_t(((PI-theta)/PI)*height));
+		}
+		h.bsdf_ptr = (BSDF*)&(material->bsdf);
+	}
+	h.p = r.d * h.t + r.e;
+}
 } /* _462 */
 
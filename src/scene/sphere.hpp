@@ -27,7 +27,8 @@ public:
     virtual ~Sphere();
     virtual void render() const;
     virtual bool hit(const Ray& r, real_t t0, real_t t1, hitRecord& h, bool fullRecord) const;
-    virtual void hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1Ptr, std::vector<hitRecord>& hs, bool fullRecord) const;
+    virtual void hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1Ptr, hitRecord* hs, bool fullRecord) const;
+    virtual void shade(const Ray& r, hitRecord& h) const;
     virtual void InitGeometry();
 	virtual float get_area();
 	Vector3 sample(float r1, float r2, Vector3 *n_ptr);
@@ -34,17 +34,17 @@ namespace _462 {
 
         glBegin(GL_TRIANGLES);
 
-        glNormal3dv( &vertices[0].normal.x );
-        glTexCoord2dv( &vertices[0].tex_coord.x );
-        glVertex3dv( &vertices[0].position.x );
+        glNormal3d( vertices[0].normal.x, vertices[0].normal.y, vertices[0].normal.z );
+        glTexCoord2d( vertices[0].tex_coord.x, vertices[0].tex_coord.y );
+        glVertex3d( vertices[0].position.x, vertices[0].position.y, vertices[0].position.z );
 
-        glNormal3dv( &vertices[1].normal.x );
-        glTexCoord2dv( &vertices[1].tex_coord.x );
-        glVertex3dv( &vertices[1].position.x);
+        glNormal3d( vertices[1].normal.x, vertices[1].normal.y, vertices[1].normal.z );
+        glTexCoord2d( vertices[1].tex_coord.x, vertices[1].tex_coord.y );
+        glVertex3d( vertices[1].position.x, vertices[1].position.y, vertices[1].position.z );
 
-        glNormal3dv( &vertices[2].normal.x );
-        glTexCoord2dv( &vertices[2].tex_coord.x );
-        glVertex3dv( &vertices[2].position.x);
+        glNormal3d( vertices[2].normal.x, vertices[2].normal.y, vertices[2].normal.z );
+        glTexCoord2d( vertices[2].tex_coord.x, vertices[2].tex_coord.y );
+        glVertex3d( vertices[2].position.x, vertices[2].position.y, vertices[2].position.z );
 
         glEnd();
 
@@ -135,72 +135,79 @@ namespace _462 {
         Matrix4 mat;
         make_transformation_matrix(&mat, position,orientation,scale);
 
+        Vector3 p[3];
+        bb = BoundingBox();
         for(int i=0;i<3;i++)
-            bb.AddPoint(project(mat*Vector4(vertices[i].position,1)));
+        {
+            p[i] = project(mat*Vector4(vertices[i].position,1));
+            bb.AddPoint(p[i]);
+        }
+
+        for(int i=0;i<3;i++)
+        {
+            bake_v0[i] = p[0][i];
+            bake_e1[i] = p[1][i] - p[0][i];
+            bake_e2[i] = p[2][i] - p[0][i];
+        }
     }
 
-    void Triangle::hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1Ptr, std::vector<hitRecord>& hs, bool fullRecord) const {
-        /*Matrix4 nm = this->invMat;
-        nm(3,0)=0;
-        nm(3,1)=0;
-        nm(3,2)=0;
+    void Triangle::shade(const Ray& r, hitRecord& hR) const
+    {
+        real_t mult[3];
+        mult[0] = 1-hR.beta-hR.gamma;
+        mult[1] = hR.beta;
+        mult[2] = hR.gamma;
 
-        Ray rays[256];
-        for(int i=start;i<end;i++)
-        {
-            rays[i] = packet.rays[i];
-            packet.rays[i].transform(invMat);
-        }*/
-        // TODO: static
-        float *texCoord_x, *texCoord_y, 
-            *norm_x, *norm_y, *norm_z;
+        Vector2 texCoord(0,0);
+        for(int i=0;i<3;i++)
+            texCoord += mult[i]*vertices[i].tex_coord;
+
+        texCoord[0] = fmod(texCoord[0],1.0);
+        texCoord[1] = fmod(texCoord[1],1.0);
+        if(texCoord[0]<0) texCoord[0]+=1;
+        if(texCoord[1]<0) texCoord[1]+=1;
+
+        const Material* materials[] = { vertices[0].material,vertices[1].material,vertices[2].material };
+        if(!simple)
+            getMaterialProperties(hR.mp, mult, texCoord, materials);
+        else
+            getMaterialProperties(hR.mp,texCoord, materials[0]);
 
-        texCoord_x = new float[end - start];
-        texCoord_y = new float[end - start];
-        norm_x = new float[end - start];
-        norm_y = new float[end - start];
-        norm_z = new float[end - start];
+        hR.n = Vector3(0,0,0);
+        for(int i=0;i<3;i++)
+            hR.n += mult[i]*vertices[i].normal;
+        hR.n = normalize( normMat*hR.n);
 
-        int *hit_flag = new int[end - start];
+		if (materials[0])
+			hR.bsdf_ptr = (BSDF*)&(materials[0]->bsdf);
+		Vector3 x, y, z = hR.n;
+		coordinate_system(z, &x, &y);
+			
+		hR.shading_trans = Matrix3(x, y, z);
+		inverse(&hR.inv_shading_trans, hR.shading_trans);
+		hR.p = r.d * hR.t + r.e;
+    }
+
+    void Triangle::hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1Ptr, hitRecord* hs, bool) const {
+        FrameArena& arena = FrameArena::local();
+        FrameArena::Scope scope(arena);
+        float *bary_u = arena.alloc<float>(end - start);
+        float *bary_v = arena.alloc<float>(end - start);
+        int *hit_flag = arena.alloc<int>(end - start);
 
         ispc::hit_triangle(packet.e_x, packet.e_y, packet.e_z, packet.d_x, packet.d_y, packet.d_z,
             t0, t1Ptr, 
-            (double*)&vertices[0],(double*)&vertices[1],(double*)&vertices[2], (this->invMat._m),
-            start, end, (int)fullRecord, 
-            hit_flag, texCoord_x, texCoord_y, norm_x, norm_y, norm_z);
-        const Material* materials[] = { vertices[0].material,vertices[1].material,vertices[2].material };
+            (float*)bake_v0, (float*)bake_e1, (float*)bake_e2,
+            start, end, hit_flag, bary_u, bary_v);
 
         for (int i = start; i < end; i++) {
             if (hit_flag[i - start]) {
                 hs[i].t = t1Ptr[i];
-                Vector2 texCoord(texCoord_x[i - start], texCoord_y[i - start]);
-
-                // TODO: interpolation
-                //if(!simple)
-                //getMaterialProperties(hs[i].mp, mult, texCoord, materials);
-                //else
-                getMaterialProperties(hs[i].mp,texCoord, materials[0]);
-                hs[i].n = Vector3(norm_x[i - start], norm_y[i - start], norm_z[i - start]);
-				if (materials[0])
-					hs[i].bsdf_ptr = (BSDF*)&(materials[0]->bsdf);
-				Vector3 x, y, z = hs[i].n;
-				coordinate_system(z, &x, &y);
-			
-				hs[i].shading_trans = Matrix3(x, y, z);
-				inverse(&hs[i].inv_shading_trans, hs[i].shading_trans);
 				hs[i].shape_ptr = (Geometry*)this;
-				hs[i].p = packet.rays[i].d * hs[i].t + packet.rays[i].e;
+                hs[i].beta = bary_u[i - start];
+                hs[i].gamma = bary_v[i - start];
             }
         }
-
-        /*for(int i=start;i<end;i++)
-             packet.rays[i]= rays[i];*/
-
-        delete[] texCoord_x;
-        delete[] texCoord_y;
-        delete[] norm_x;
-        delete[] norm_y;
-        delete[] norm_z;
     }
     
 	float Triangle::get_area() {
@@ -227,88 +234,43 @@ namespace _462 {
 		return 1.f / get_area();
 	}
 
-    bool Triangle::hit(const Ray& r, const real_t t0, const real_t t1, hitRecord& hR, bool fullRecord) const
+    bool Triangle::intersect(const Ray& r, const Vector3& v0, const Vector3& e1, const Vector3& e2,
+        real_t t0, real_t t1, real_t* t, real_t* beta, real_t* gamma)
     {
-        Ray tRay = r.transform(invMat);
-
-        real_t mult[3];
-
-        Vector3 a_minus_b = vertices[0].position - vertices[1].position;
-        Vector3 a_minus_c = vertices[0].position - vertices[2].position;
-        Vector3 a_minus_e = vertices[0].position - tRay.e;
-
-        real_t a = a_minus_b.x;
-        real_t b = a_minus_b.y;
-        real_t c = a_minus_b.z;
-        real_t d = a_minus_c.x;
-        real_t e = a_minus_c.y;
-        real_t f = a_minus_c.z;
-        real_t g = tRay.d.x;
-        real_t h = tRay.d.y;
-        real_t i = tRay.d.z;
-        real_t j = a_minus_e.x;
-        real_t k = a_minus_e.y;
-        real_t l = a_minus_e.z;
-
-        real_t ei_minus_hf = e * i - h * f;
-        real_t gf_minus_di = g * f - d * i;
-        real_t dh_minus_eg = d * h - e * g;
-        real_t ak_minus_jb = a * k - j * b;
-        real_t jc_minus_al = j * c - a * l;
-        real_t bl_minus_kc = b * l - k * c;
-
-        real_t M = a * ei_minus_hf + b * gf_minus_di + c * dh_minus_eg;
-        real_t time = (f * ak_minus_jb + e * jc_minus_al + d * bl_minus_kc) / -M;
-        if (time <= t0 || time >= t1) {
+        Vector3 pvec = cross(r.d, e2);
+        real_t det = dot(e1, pvec);
+        if (det == 0)
             return false;
-        }
+        real_t inv_det = 1 / det;
 
-        real_t beta = (j * ei_minus_hf + k * gf_minus_di + l * dh_minus_eg) / M;
-        if (beta < 0 || beta > 1)
+        Vector3 tvec = r.e - v0;
+        *beta = dot(tvec, pvec) * inv_det;
+        if (*beta < 0 || *beta > 1)
             return false;
 
-        real_t gamma = (i * ak_minus_jb + h * jc_minus_al + g * bl_minus_kc) / M;
-        if (gamma < 0 || gamma > 1 - beta)
+        Vector3 qvec = cross(tvec, e1);
+        *gamma = dot(r.d, qvec) * inv_det;
+        if (*gamma < 0 || *gamma > 1 - *beta)
             return false;
 
-        hR.t = time;
-		hR.shape_ptr = (Geometry*)this;
-
-        if (!fullRecord)
-            return true;
-
-        mult[0] = 1-beta-gamma;
-        mult[1] = beta;
-        mult[2] = gamma;
-
-        Vector2 texCoord(0,0);
-        for(int i=0;i<3;i++)
-            texCoord += mult[i]*vertices[i].tex_coord;
-
-        texCoord[0] = fmod(texCoord[0],1.0);
-        texCoord[1] = fmod(texCoord[1],1.0);
-        if(texCoord[0]<0) texCoord[0]+=1;
-        if(texCoord[1]<0) texCoord[0]+=1;
+        *t = dot(e2, qvec) * inv_det;
+        return *t > t0 && *t < t1;
+    }
 
-        const Material* materials[] = { vertices[0].material,vertices[1].material,vertices[2].material };
-        if(!simple)
-            getMaterialProperties(hR.mp, mult, texCoord, materials);
-        else
-            getMaterialProperties(hR.mp,texCoord, materials[0]);
+    bool Triangle::hit(const Ray& r, const real_t t0, const real_t t1, hitRecord& hR, bool) const
+    {
+        Vector3 v0(bake_v0[0], bake_v0[1], bake_v0[2]);
+        Vector3 e1(bake_e1[0], bake_e1[1], bake_e1[2]);
+        Vector3 e2(bake_e2[0], bake_e2[1], bake_e2[2]);
 
-        hR.n = Vector3(0,0,0);
-        for(int i=0;i<3;i++)
-            hR.n += mult[i]*vertices[i].normal;
-        hR.n = normalize( normMat*hR.n);
+        real_t time, beta, gamma;
+        if (!intersect(r, v0, e1, e2, t0, t1, &time, &beta, &gamma))
+            return false;
 
-		if (materials[0])
-			hR.bsdf_ptr = (BSDF*)&(materials[0]->bsdf);
-		Vector3 x, y, z = hR.n;
-		coordinate_system(z, &x, &y);
-			
-		hR.shading_trans = Matrix3(x, y, z);
-		inverse(&hR.inv_shading_trans, hR.shading_trans);
-		hR.p = r.d * time + r.e;
+        hR.t = time;
+		hR.shape_ptr = (Geometry*)this;
+        hR.beta = beta;
+        hR.gamma = gamma;
 
         return true;
     }
@@ -36,13 +36,27 @@ public:
     // the triangle's vertices, in CCW order
     Vertex vertices[3];
     bool simple;
+
+    // First vertex and the two edges leaving it, baked by InitGeometry in
+    // the space rays arrive in (world space, or model space for meshes),
+    // so intersection needs no per-ray transform.
+    float bake_v0[3];
+    float bake_e1[3];
+    float bake_e2[3];
+
     Triangle();
     virtual ~Triangle();
     virtual void render() const;
 	
     virtual bool hit(const Ray& r, real_t t0, real_t t1, hitRecord& h, bool fullRecord) const;
-    virtual void hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1, std::vector<hitRecord>& hs, bool fullRecord) const;
+    virtual void hitPacket(const Packet& packet, int start, int end, real_t t0, real_t *t1, hitRecord* hs, bool fullRecord) const;
+    virtual void shade(const Ray& r, hitRecord& h) const;
     virtual void InitGeometry();
+    // Moller-Trumbore test of r against the triangle at v0 with edges e1
+    // and e2. On a hit in (t0, t1) returns the distance and the weights of
+    // the second and third vertex.
+    static bool intersect(const Ray& r, const Vector3& v0, const Vector3& e1, const Vector3& e2,
+        real_t t0, real_t t1, real_t* t, real_t* beta, real_t* gamma);
     static bool getBarycentricCoordinates(const Ray& r, real_t& t,real_t mult[3], Vector3 position[3]);
     static void getMaterialProperties(MaterialProp& mp, const real_t mult[3],const Vector2& texCoord, const Material* materials[3]);
     static void getMaterialProperties(MaterialProp& mp, const Vector2& texCoord, const Material* materials);